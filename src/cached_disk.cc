@@ -0,0 +1,248 @@
+#include "cached_disk.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "log.h"
+#include "utils.h"
+
+CachedDisk::CachedDisk(const std::string &filename, DiskMode mode,
+                       uint64_t cache_size)
+    : mode_(mode) {
+  struct stat sb;
+
+  fd_ = open(filename.c_str(),
+             (mode == DiskMode::Private) ? O_RDONLY : O_RDWR);
+  if (fd_ < 0) {
+    std::cerr << "Cannot open file " << filename << std::endl;
+    exit(0);
+  }
+  if ((fstat(fd_, &sb) < 0) || (sb.st_size == 0)) {
+    std::cerr << "Cannot use empty disk image " << filename << std::endl;
+    exit(0);
+  }
+  size_ = sb.st_size;
+  capacity_ = std::max<uint64_t>(cache_size / BLOCK_CACHE_BLOCK_SIZE, 1);
+  LOG_SYSTEM("disk: %s, size: 0x%lx, cache: %ld blocks of 0x%lx\n",
+             filename.c_str(), size_, capacity_, BLOCK_CACHE_BLOCK_SIZE);
+}
+
+CachedDisk::~CachedDisk() {
+  flush();
+  close(fd_);
+  LOG_SYSTEM("disk: cache hits %ld, misses %ld\n", hits_, misses_);
+}
+
+// The last block is short if the image size is not a multiple of the block
+// size.
+uint64_t CachedDisk::block_len(uint64_t index) const {
+  return std::min<uint64_t>(BLOCK_CACHE_BLOCK_SIZE,
+                            size_ - index * BLOCK_CACHE_BLOCK_SIZE);
+}
+
+bool CachedDisk::write_block(const Block &block) {
+  if (!util::pwrite_full(fd_, block.data.get(), block_len(block.index),
+                         block.index * BLOCK_CACHE_BLOCK_SIZE)) {
+    perror("pwrite");
+    return false;
+  }
+  return true;
+}
+
+// Drop the least recently used block, writing it back first if it is dirty.
+// A block whose write-back fails is kept, and the next least recently used
+// one is tried. Returns false if no block could be dropped.
+bool CachedDisk::evict() {
+  for (auto it = lru_.end(); it != lru_.begin();) {
+    --it;
+    if (it->dirty && !write_block(*it)) {
+      continue;
+    }
+    map_.erase(it->index);
+    lru_.erase(it);
+    return true;
+  }
+  return false;
+}
+
+// Return the cached block, reading it from the file on a miss.
+// Called with mutex_ held.
+CachedDisk::Block *CachedDisk::fetch(uint64_t index) {
+  bool sequential = (index == last_block_ + 1) || (index == last_block_);
+  last_block_ = index;
+
+  auto it = map_.find(index);
+  if (it != map_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    hits_++;
+    return &*it->second;
+  }
+  misses_++;
+
+  // Double the read-ahead window while the guest keeps reading sequentially.
+  if (sequential) {
+    readahead_ = std::min<uint64_t>(
+        {std::max<uint64_t>(readahead_ * 2, 1), MAX_READAHEAD_BLOCKS,
+         capacity_ / 2});
+  } else {
+    readahead_ = 0;
+  }
+  uint64_t num_blocks = (size_ + BLOCK_CACHE_BLOCK_SIZE - 1) /
+                        BLOCK_CACHE_BLOCK_SIZE;
+  uint64_t count = 1;
+  while ((count <= readahead_) && (index + count < num_blocks) &&
+         !map_.count(index + count)) {
+    count++;
+  }
+
+  std::vector<Block> blocks(count);
+  std::vector<struct iovec> iov(count);
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    blocks[i].index = index + i;
+    blocks[i].data = std::make_unique<uint8_t[]>(BLOCK_CACHE_BLOCK_SIZE);
+    blocks[i].dirty = false;
+    iov[i].iov_base = blocks[i].data.get();
+    iov[i].iov_len = block_len(index + i);
+    total += iov[i].iov_len;
+  }
+  ssize_t n = preadv(fd_, iov.data(), count, index * BLOCK_CACHE_BLOCK_SIZE);
+  if (n != (ssize_t)total) {
+    // Short read: fall back to one pread per block.
+    for (uint64_t i = 0; i < count; i++) {
+      if (!util::pread_full(fd_, iov[i].iov_base, iov[i].iov_len,
+                            (index + i) * BLOCK_CACHE_BLOCK_SIZE)) {
+        perror("pread");
+        return nullptr;
+      }
+    }
+  }
+
+  // Insert the read-ahead blocks first so that the requested one ends up most
+  // recently used.
+  for (uint64_t i = count; i-- > 0;) {
+    while (lru_.size() >= capacity_) {
+      if (!evict()) {
+        // Every cached block is dirty and cannot be written back.
+        return nullptr;
+      }
+    }
+    lru_.push_front(std::move(blocks[i]));
+    map_[index + i] = lru_.begin();
+  }
+  return &lru_.front();
+}
+
+bool CachedDisk::read(uint64_t offset, uint8_t *dst, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (len) {
+    uint64_t index = offset / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t in_block = offset % BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t n = std::min<uint64_t>(len, BLOCK_CACHE_BLOCK_SIZE - in_block);
+    const uint8_t *src;
+    auto priv = private_.find(index);
+    if (priv != private_.end()) {
+      src = priv->second.get();
+    } else {
+      Block *block = fetch(index);
+      if (!block) {
+        return false;
+      }
+      src = block->data.get();
+    }
+    memcpy(dst, src + in_block, n);
+    offset += n;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool CachedDisk::write(uint64_t offset, const uint8_t *src, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (len) {
+    uint64_t index = offset / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t in_block = offset % BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t n = std::min<uint64_t>(len, BLOCK_CACHE_BLOCK_SIZE - in_block);
+    if (mode_ == DiskMode::Private) {
+      auto priv = private_.find(index);
+      if (priv == private_.end()) {
+        // Only add the block once its copy exists: a failed fetch must not
+        // leave an empty entry behind for read() to find.
+        Block *block = fetch(index);
+        if (!block) {
+          return false;
+        }
+        auto data = std::make_unique<uint8_t[]>(BLOCK_CACHE_BLOCK_SIZE);
+        memcpy(data.get(), block->data.get(), BLOCK_CACHE_BLOCK_SIZE);
+        priv = private_.emplace(index, std::move(data)).first;
+      }
+      memcpy(priv->second.get() + in_block, src, n);
+    } else if (mode_ == DiskMode::Writeback) {
+      Block *block = fetch(index);
+      if (!block) {
+        return false;
+      }
+      memcpy(block->data.get() + in_block, src, n);
+      block->dirty = true;
+    } else {
+      // Shared: write through and keep a cached copy up to date.
+      if (!util::pwrite_full(fd_, src, n, offset)) {
+        perror("pwrite");
+        return false;
+      }
+      auto it = map_.find(index);
+      if (it != map_.end()) {
+        memcpy(it->second->data.get() + in_block, src, n);
+      }
+    }
+    offset += n;
+    src += n;
+    len -= n;
+  }
+  return true;
+}
+
+// A block that fails to write or sync stays dirty for the next flush.
+bool CachedDisk::flush() {
+  if (mode_ == DiskMode::Private) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Block *> written;
+  bool ok = true;
+  for (Block &block : lru_) {
+    if (!block.dirty) {
+      continue;
+    }
+    if (write_block(block)) {
+      block.dirty = false;
+      written.push_back(&block);
+    } else {
+      ok = false;
+    }
+  }
+  if (fdatasync(fd_) < 0) {
+    perror("fdatasync");
+    for (Block *block : written) {
+      block->dirty = true;
+    }
+    return false;
+  }
+  return ok;
+}
@@ -0,0 +1,76 @@
+#include "clock.h"
+
+#include <algorithm>
+
+#include "log.h"
+
+Clock::Clock(const TimerOptions &options, const uint64_t *icount)
+    : source_(options.clock), warp_(options.warp),
+      start_(std::chrono::steady_clock::now()), icount_(icount) {}
+
+uint64_t Clock::now() const {
+  if (source_ == TimerClock::Icount) {
+    return *icount_ + skipped_ticks_;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_);
+  return elapsed.count() / TIMER_NS_PER_TICK + skipped_ticks_;
+}
+
+// With the instruction clock a tick is an instruction, so the distance is
+// exact. With the host clock it says nothing about how many instructions run
+// until then, so the check comes after at most TIMER_HOST_POLL instructions
+// and may be late by up to that many.
+uint64_t Clock::check_point(uint64_t ticks) const {
+  uint64_t now = this->now();
+  if (ticks <= now) {
+    return *icount_;
+  }
+  uint64_t distance = ticks - now;
+  if (source_ == TimerClock::Host) {
+    distance = std::min(distance, TIMER_HOST_POLL);
+  }
+  return (distance > UINT64_MAX - *icount_) ? UINT64_MAX : *icount_ + distance;
+}
+
+// Host time ticks after base, saturated at time_point::max(), so a far
+// deadline such as ~0 means none rather than one in the past.
+static std::chrono::steady_clock::time_point
+after(std::chrono::steady_clock::time_point base, uint64_t ticks) {
+  auto room = std::chrono::steady_clock::time_point::max() - base;
+  if (ticks > (uint64_t)room.count() / TIMER_NS_PER_TICK) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  return base + std::chrono::nanoseconds(ticks * TIMER_NS_PER_TICK);
+}
+
+std::chrono::steady_clock::time_point Clock::host_time(uint64_t ticks) const {
+  if (source_ == TimerClock::Icount) {
+    uint64_t now = this->now();
+    return after(std::chrono::steady_clock::now(),
+                 (ticks > now) ? ticks - now : 0);
+  }
+  return after(start_, (ticks > skipped_ticks_) ? ticks - skipped_ticks_ : 0);
+}
+
+void Clock::idle(std::chrono::nanoseconds slept, uint64_t limit) {
+  if (source_ != TimerClock::Icount) {
+    return;
+  }
+  uint64_t now = this->now();
+  uint64_t ticks = slept.count() / TIMER_NS_PER_TICK;
+  if (limit > now) {
+    ticks = std::min(ticks, limit - now);
+  }
+  skipped_ticks_ += ticks;
+}
+
+bool Clock::warp_to(uint64_t ticks) {
+  uint64_t now = this->now();
+  if ((ticks <= now) || (ticks - now > TIMER_WARP_HORIZON)) {
+    return false;
+  }
+  skipped_ticks_ += ticks - now;
+  LOG_CPU("clock: warp 0x%lx ticks\n", ticks - now);
+  return true;
+}
@@ -16,72 +16,145 @@ typedef __attribute__((mode(TI))) unsigned int uint128_t;
 typedef __attribute__((mode(TI))) int int128_t;
 
 Cpu::Cpu(uint64_t entry, uint64_t sp_base, uint64_t text_start,
-         uint64_t text_size, uint64_t map_base, const std::string &diskname)
-    : bus(Bus(text_start, text_size, map_base, diskname)) {
+         uint64_t text_size, uint64_t map_base, uint64_t ram_size,
+         const DiskOptions &disk_options, const UartOptions &uart_options,
+         const TimerOptions &timer_options)
+    : bus(Bus(text_start, text_size, map_base, ram_size, disk_options,
+              uart_options)),
+      clock(timer_options, &icount) {
   pc = entry;
   sp = sp_base;
   LOG_SYSTEM("Init pc=0x%lx, sp=0x%lx\n", pc, sp);
 
   mmu.init(&bus, &CurrentEL);
+  bus.events.set_clock(&clock);
+  timer.init(&bus.gic, &bus.events, cpu_id, &clock);
 }
 
 void Cpu::check_interrupt() {
-  if ((daif >> 9) & 0x1) {
-    // Interrupt masked
+  // Device and timer events are turned into GIC state even while interrupts
+  // are masked, since drivers may poll.
+  if (icount >= bus.events.next()) {
+    bus.events.run();
+  }
+  if ((daif & DAIF_I) || !bus.gic.irq_line(cpu_id)) {
     return;
   }
-  if (bus.virtio.is_interrupting()) {
-    bus.virtio.disk_access(this);
-    LOG_SYSTEM("[Virtio] Jump to exception vector table: vbar_el1=0x%lx + "
-               "0x280 = 0x%lx, "
-               "pc=0x%lx, sp=0x%lx\n",
-               VBAR_EL1, VBAR_EL1 + 0x480, pc, sp);
-    cause_interrupt(0x30);
-  } else if ((util::bit(pc, 63) == 0) && (timer_count % 100 == 0)) {
-    LOG_SYSTEM("[Timer] Jump to exception vector table: vbar_el1=0x%lx + 0x280 "
-               "= 0x%lx, "
-               "pc=0x%lx, sp=0x%lx\n",
-               VBAR_EL1, VBAR_EL1 + 0x280, pc, sp);
-    cause_interrupt(0x1b);
-  } else if (bus.uart.is_interrupting()) {
-    LOG_SYSTEM("[Uart] Jump to exception vector table: vbar_el1=0x%lx + 0x280 "
-               "= 0x%lx, "
-               "pc=0x%lx, sp=0x%lx\n",
-               VBAR_EL1, VBAR_EL1 + 0x280, pc, sp);
-    cause_interrupt(0x21);
-  }
-}
-
-void Cpu::cause_interrupt(uint64_t irq) {
+  LOG_CPU("IRQ: vbar_el1=0x%lx, pc=0x%lx, sp=0x%lx\n", VBAR_EL1, pc, sp);
   ELR_EL1 = pc;
-  ICC_IAR1_EL1 = irq;
+  take_exception(0x80);
+}
+
+// PSTATE as saved to SPSR_EL1: NZCV, DAIF and the exception level, using
+// SP_EL1 at EL1 (EL1h) and SP_EL0 at EL0 (EL0t).
+uint64_t Cpu::pstate() const {
+  return ((uint64_t)nzcv.N << 31) | ((uint64_t)nzcv.Z << 30) |
+         ((uint64_t)nzcv.C << 29) | ((uint64_t)nzcv.V << 28) | daif |
+         ((el == 1) ? 0b0101 : 0b0000);
+}
+
+// Take an exception to EL1. vector_offset selects the type in the vector
+// table: 0x0 synchronous, 0x80 IRQ. ELR_EL1 is set by the caller.
+void Cpu::take_exception(uint64_t vector_offset) {
+  SPSR_EL1 = pstate();
+  daif = DAIF_D | DAIF_A | DAIF_I | DAIF_F;
   if (el == 0) {
-    SPSR_EL1 = (SPSR_EL1 >> 3) << 3;
     SP_EL0 = sp;
     sp = SP_EL1;
     el = 1;
-    set_pc(VBAR_EL1 + 0x480);
+    // Lower EL using AArch64
+    set_pc(VBAR_EL1 + 0x400 + vector_offset);
   } else {
-    SPSR_EL1 = ((SPSR_EL1 >> 3) << 3) | 0b101;
-    set_pc(VBAR_EL1 + 0x280);
+    // Current EL with SP_ELx
+    set_pc(VBAR_EL1 + 0x200 + vector_offset);
+  }
+}
+
+// eret: restore PSTATE from SPSR_EL1 and return to ELR_EL1.
+void Cpu::exception_return() {
+  SP_EL1 = sp;
+  set_pc(ELR_EL1);
+  nzcv.N = util::bit(SPSR_EL1, 31);
+  nzcv.Z = util::bit(SPSR_EL1, 30);
+  nzcv.C = util::bit(SPSR_EL1, 29);
+  nzcv.V = util::bit(SPSR_EL1, 28);
+  daif = SPSR_EL1 & (DAIF_D | DAIF_A | DAIF_I | DAIF_F);
+  if (util::shift(SPSR_EL1, 2, 3) == 0) {
+    el = 0;
+    sp = SP_EL0;
+  }
+  event_register = true;
+}
+
+// WFI, and WFE without a pending event: sleep the host thread until an
+// interrupt is pending for this CPU, even if masked by PSTATE.I, a device
+// thread posts an event or the next timed event is due. With --warp the
+// clock jumps to that event at once when no disk request is in flight.
+void Cpu::wait_for_interrupt(bool wfe) {
+  if (wfe && event_register) {
+    event_register = false;
+    return;
   }
+  bus.events.run();
+  if (bus.gic.irq_line(cpu_id)) {
+    return;
+  }
+  uint64_t deadline = bus.events.deadline();
+  if (clock.warp_enabled() && bus.virtio.idle() && clock.warp_to(deadline)) {
+    // Only timed events can wake the CPU, so skip the wait.
+    bus.events.run();
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  bus.wakeup.wait_until(
+      std::min(clock.host_time(deadline), start + WFI_MAX_SLEEP), [this] {
+        bus.events.run();
+        return bus.gic.irq_line(cpu_id);
+      });
+  clock.idle(std::chrono::steady_clock::now() - start, deadline);
+  bus.events.run();
 }
 
 uint32_t Cpu::fetch() {
   // show_regs();
   // show_stack();
-  return bus.load(mmu.mmu_translate(pc), MemAccessSize::Word);
+  return load<uint32_t>(pc);
 }
 
 uint64_t Cpu::load(uint64_t address, MemAccessSize size) {
-  // LOG_SYSTEM("load 0x%lx\n", address);
-  uint64_t paddr = mmu.mmu_translate(address);
-  return bus.load(paddr, size);
+  switch (size) {
+  case MemAccessSize::Byte:
+    return load<uint8_t>(address);
+  case MemAccessSize::Hex:
+    return load<uint16_t>(address);
+  case MemAccessSize::Word:
+    return load<uint32_t>(address);
+  case MemAccessSize::DWord:
+    return load<uint64_t>(address);
+  default:
+    assert(false);
+    // dummy
+    return 0;
+  }
 }
 
 void Cpu::store(uint64_t address, uint64_t value, MemAccessSize size) {
-  uint64_t paddr = mmu.mmu_translate(address);
-  bus.store(paddr, value, size);
+  switch (size) {
+  case MemAccessSize::Byte:
+    store<uint8_t>(address, value);
+    break;
+  case MemAccessSize::Hex:
+    store<uint16_t>(address, value);
+    break;
+  case MemAccessSize::Word:
+    store<uint32_t>(address, value);
+    break;
+  case MemAccessSize::DWord:
+    store<uint64_t>(address, value);
+    break;
+  default:
+    assert(false);
+  }
 }
 
 void Cpu::decode_start(uint32_t inst) {
@@ -398,8 +471,7 @@ void Cpu::decode_branches(uint32_t inst) {
         LOG_CPU("System instructions with register argument\n");
         unsupported();
       } else if (util::shift(inst, 12, 17) == 0b110010) {
-        LOG_CPU("Hints\n");
-        unsupported();
+        decode_hints(inst);
       } else if (util::shift(inst, 12, 17) == 0b110011) {
         decode_barriers(inst);
       } else if (util::shift(inst, 12, 15) == 0b0100) {
@@ -937,21 +1009,21 @@ void Cpu::decode_ldst_register_pair(uint32_t inst) {
 
   if (if_load) {
     if (if_32bit) {
-      xregs[rt] = load(address, MemAccessSize::Word);
-      xregs[rt2] = load(address + 4, MemAccessSize::Word);
+      xregs[rt] = load<uint32_t>(address);
+      xregs[rt2] = load<uint32_t>(address + 4);
     } else {
-      xregs[rt] = load(address, MemAccessSize::DWord);
-      xregs[rt2] = load(address + 8, MemAccessSize::DWord);
+      xregs[rt] = load<uint64_t>(address);
+      xregs[rt2] = load<uint64_t>(address + 8);
     }
   } else {
     data1 = xregs[rt];
     data2 = xregs[rt2];
     if (if_32bit) {
-      store(address, data1, MemAccessSize::Word);
-      store(address + 4, data2, MemAccessSize::Word);
+      store<uint32_t>(address, data1);
+      store<uint32_t>(address + 4, data2);
     } else {
-      store(address, data1, MemAccessSize::DWord);
-      store(address + 8, data2, MemAccessSize::DWord);
+      store<uint64_t>(address, data1);
+      store<uint64_t>(address + 8, data2);
     }
   }
 
@@ -1019,13 +1091,13 @@ void Cpu::decode_ldst_reg_unscaled_immediate([[maybe_unused]] uint32_t inst) {
   if (opc != 0) {
     switch (size) {
     case 1:
-      data = load(address, MemAccessSize::Hex);
+      data = load<uint16_t>(address);
       break;
     case 2:
-      data = load(address, MemAccessSize::Word);
+      data = load<uint32_t>(address);
       break;
     case 3:
-      data = load(address, MemAccessSize::DWord);
+      data = load<uint64_t>(address);
       break;
     default:
       unsupported();
@@ -1097,11 +1169,11 @@ void Cpu::decode_ldst_reg_unsigned_imm(uint32_t inst) {
     addr = (rn == 31) ? sp + offset : xregs[rn] + offset;
     switch (opc) {
     case 0:
-      store(addr, xregs[rt], MemAccessSize::Word);
+      store<uint32_t>(addr, xregs[rt]);
       LOG_CPU("str x%d(=0x%lx), [x%d, #%ld]\n", rt, xregs[rt], rn, offset);
       break;
     case 1:
-      value = load(addr, MemAccessSize::Word);
+      value = load<uint32_t>(addr);
       xregs[rt] = util::set_lower(xregs[rt], value, MemAccessSize::Word);
       LOG_CPU("ldr x%d(=0x%lx), [x%d, #%ld]\n", rt, xregs[rt], rn, offset);
       break;
@@ -1117,12 +1189,12 @@ void Cpu::decode_ldst_reg_unsigned_imm(uint32_t inst) {
     addr = (rn == 31) ? sp + offset : xregs[rn] + offset;
     switch (opc) {
     case 0:
-      store(addr, xregs[rt], MemAccessSize::DWord);
+      store<uint64_t>(addr, xregs[rt]);
       LOG_CPU("str x%d(=0x%lx), [x%d(=0x%lx), #%ld]\n", rt, xregs[rt], rn,
               xregs[rn], offset);
       break;
     case 1:
-      xregs[rt] = load(addr, MemAccessSize::DWord);
+      xregs[rt] = load<uint64_t>(addr);
       LOG_CPU("ldr x%d(=0x%lx), [x%d, #%ld]\n", rt, xregs[rt], rn, offset);
       break;
     case 2:
@@ -1402,7 +1474,7 @@ void Cpu::decode_ldst_reg_reg_offset(uint32_t inst) {
       address = (rn == 31) ? sp + offset : xregs[rn] + offset;
       LOG_CPU("ldr x%d, [x%d, x%d {#%d}] (=0x%lx)\n", rt, rn, rm, shift * 3,
               xregs[rn] + offset);
-      xregs[rt] = load(address, MemAccessSize::DWord) &
+      xregs[rt] = load<uint64_t>(address) &
                   util::mask(8 * std::pow(2, size));
       break;
     }
@@ -1438,7 +1510,7 @@ void Cpu::decode_ldst_load_register_literal(uint32_t inst) {
 
   offset = util::SIGN_EXTEND(imm19 << 2, 21);
   address = pc + offset;
-  data = load(address, MemAccessSize::DWord);
+  data = load<uint64_t>(address);
 
   switch (opc) {
   case 0:
@@ -2206,16 +2278,7 @@ void Cpu::decode_exception_generation(uint32_t inst) {
     case 1:
       ELR_EL1 = pc + 4;
       ESR_EL1 |= (21 << 26);
-      if (el == 0) {
-        SPSR_EL1 = (SPSR_EL1 >> 3) << 3;
-        SP_EL0 = sp;
-        sp = SP_EL1;
-        el = 1;
-        set_pc(VBAR_EL1 + 0x400);
-      } else {
-        SPSR_EL1 = ((SPSR_EL1 >> 3) << 3) | 0b101;
-        set_pc(VBAR_EL1 + 0x200);
-      }
+      take_exception(0x0);
       LOG_CPU("SVC: w7=%ld, w0=%ld, w1=0x%lx, pc=0x%lx, SP_EL0=0x%lx, "
               "SP_EL1=0x%lx, jump to 0x%lx\n",
               xregs[7], xregs[0], xregs[1], pc, SP_EL0, SP_EL1,
@@ -2262,7 +2325,6 @@ void Cpu::decode_pstate(uint32_t inst) {
   if (rt != 31) {
     unallocated();
   }
-  uint64_t mask;
 
   switch (op2) {
   case 0:
@@ -2286,8 +2348,7 @@ void Cpu::decode_pstate(uint32_t inst) {
         LOG_CPU("msr daifset(=0x%lx), 0x%x\n", daif, CRm);
         break;
       case 7:
-        mask = ~uint64_t(0) & (util::mask((CRm << 6) + 1) - 1);
-        daif = daif & mask;
+        daif = daif & ~(uint64_t)(CRm << 6);
         LOG_CPU("msr daifclr(=0x%lx), 0x%x\n", daif, CRm);
         break;
       default:
@@ -2301,6 +2362,50 @@ void Cpu::decode_pstate(uint32_t inst) {
   }
 }
 
+/*
+         Hints
+
+          31                  12 11  8   7  5  4    0
+         +----------------------+-------+----+-----+
+         | 11010101000000110010 |  CRm  | op2|11111|
+         +----------------------+-------+----+-----+
+*/
+void Cpu::decode_hints(uint32_t inst) {
+  uint8_t CRm = util::shift(inst, 8, 11);
+  uint8_t op2 = util::shift(inst, 5, 7);
+
+  if (CRm != 0) {
+    // BTI, PAC and the other hints have no effect here.
+    LOG_CPU("hint #0x%x\n", (CRm << 3) | op2);
+    return;
+  }
+  switch (op2) {
+  case 0b000:
+    LOG_CPU("nop\n");
+    break;
+  case 0b001:
+    LOG_CPU("yield\n");
+    break;
+  case 0b010:
+    LOG_CPU("wfe\n");
+    wait_for_interrupt(true);
+    break;
+  case 0b011:
+    LOG_CPU("wfi\n");
+    wait_for_interrupt(false);
+    break;
+  case 0b100:
+  case 0b101:
+    // SEV and SEVL: this is the only CPU.
+    LOG_CPU("sev%s\n", (op2 == 0b101) ? "l" : "");
+    event_register = true;
+    break;
+  default:
+    LOG_CPU("hint #0x%x\n", op2);
+    break;
+  }
+}
+
 /*
          Barriers
 
@@ -2499,8 +2604,13 @@ void Cpu::decode_system_register_move(uint32_t inst) {
         case 0:
           switch (op2) {
           case 0:
-            xregs[rt] = SPSR_EL1;
-            LOG_CPU("mrs x%d, spsr_el1(=0x%lx)\n", rt, SPSR_EL1);
+            if (if_get) {
+              xregs[rt] = SPSR_EL1;
+              LOG_CPU("mrs x%d, spsr_el1(=0x%lx)\n", rt, SPSR_EL1);
+            } else {
+              SPSR_EL1 = xregs[rt];
+              LOG_CPU("msr spsr_el1, x%d(=0x%lx)\n", rt, SPSR_EL1);
+            }
             break;
           case 1:
             if (if_get) {
@@ -2547,8 +2657,13 @@ void Cpu::decode_system_register_move(uint32_t inst) {
         case 6:
           switch (op2) {
           case 0:
-            ICC_PMR_EL1 = xregs[rt];
-            LOG_CPU("msr ICC_PMR_EL1 = 0x%lx\n", xregs[rt]);
+            if (if_get) {
+              xregs[rt] = bus.gic.pmr(cpu_id);
+              LOG_CPU("mrs x%d, ICC_PMR_EL1(=0x%lx)\n", rt, xregs[rt]);
+            } else {
+              bus.gic.set_pmr(cpu_id, xregs[rt]);
+              LOG_CPU("msr ICC_PMR_EL1 = 0x%lx\n", xregs[rt]);
+            }
             return;
           default:
             unsupported();
@@ -2630,23 +2745,39 @@ void Cpu::decode_system_register_move(uint32_t inst) {
             break;
           }
           break;
+        case 11:
+          switch (op2) {
+          case 5:
+            bus.gic.send_sgi(cpu_id, xregs[rt]);
+            LOG_CPU("msr ICC_SGI1R_EL1, x%d(=0x%lx)\n", rt, xregs[rt]);
+            return;
+          default:
+            unsupported();
+            break;
+          }
+          break;
         case 12:
           switch (op2) {
           case 0:
-            xregs[rt] = ICC_IAR1_EL1;
-            LOG_CPU("mrs x%d, icc_iar1_el1(=0x%lx)\n", rt, ICC_IAR1_EL1);
+            xregs[rt] = bus.gic.acknowledge(cpu_id);
+            LOG_CPU("mrs x%d, icc_iar1_el1(=0x%lx)\n", rt, xregs[rt]);
             return;
           case 1:
-            ICC_EOIR1_EL1 = xregs[rt];
-            LOG_CPU("msr icc_eoir1_el1, x%d(=0x%lx)\n", rt, ICC_EOIR1_EL1);
+            bus.gic.end_of_interrupt(cpu_id, xregs[rt]);
+            LOG_CPU("msr icc_eoir1_el1, x%d(=0x%lx)\n", rt, xregs[rt]);
             return;
           case 5:
             xregs[rt] = ICC_SRE_EL1;
             LOG_CPU("mrs x%d, ICC_SRE_EL1(=0x%lx)\n", rt, ICC_SRE_EL1);
             return;
           case 7:
-            ICC_IGRPEN1_EL1 = xregs[rt];
-            LOG_CPU("msr ICC_IGRPEN1_EL1 = 0x%lx\n", xregs[rt]);
+            if (if_get) {
+              xregs[rt] = bus.gic.igrpen1(cpu_id);
+              LOG_CPU("mrs x%d, ICC_IGRPEN1_EL1(=0x%lx)\n", rt, xregs[rt]);
+            } else {
+              bus.gic.set_igrpen1(cpu_id, xregs[rt]);
+              LOG_CPU("msr ICC_IGRPEN1_EL1 = 0x%lx\n", xregs[rt]);
+            }
             return;
           default:
             unsupported();
@@ -2674,7 +2805,7 @@ void Cpu::decode_system_register_move(uint32_t inst) {
               xregs[rt] = daif;
               LOG_CPU("mrs x%d, daif=0x%lx\n", rt, daif);
             } else {
-              daif = xregs[rt];
+              daif = xregs[rt] & (DAIF_D | DAIF_A | DAIF_I | DAIF_F);
               LOG_CPU("msr daif, x%d(=0x%lx)\n", rt, xregs[rt]);
             }
             return;
@@ -2695,6 +2826,13 @@ void Cpu::decode_system_register_move(uint32_t inst) {
             xregs[rt] = CNTFRQ_EL0;
             LOG_CPU("mrs x%d, CNTFRQ_EL0(=0x%lx)\n", rt, CNTFRQ_EL0);
             break;
+          case 1:
+          case 2:
+            // CNTPCT_EL0, CNTVCT_EL0: the virtual offset is 0.
+            xregs[rt] = timer.counter();
+            LOG_CPU("mrs x%d, CNT%cCT_EL0(=0x%lx)\n", rt,
+                    (op2 == 1) ? 'P' : 'V', xregs[rt]);
+            return;
           default:
             unsupported();
             break;
@@ -2703,16 +2841,30 @@ void Cpu::decode_system_register_move(uint32_t inst) {
         case 3:
           switch (op2) {
           case 0:
-            CNTV_TVAL_EL0 = xregs[rt];
-            LOG_CPU("msr CNTV_TVAL_EL0, x%d(=0x%lx)\n", rt, xregs[rt]);
-            break;
+            if (if_get) {
+              xregs[rt] = timer.tval();
+              LOG_CPU("mrs x%d, CNTV_TVAL_EL0(=0x%lx)\n", rt, xregs[rt]);
+            } else {
+              timer.set_tval(xregs[rt]);
+              LOG_CPU("msr CNTV_TVAL_EL0, x%d(=0x%lx)\n", rt, xregs[rt]);
+            }
+            return;
           case 1:
             if (if_get) {
-              xregs[rt] = CNTV_CTL_EL0;
-              LOG_CPU("mrs x%d, CNTV_CTL_EL0(=0x%lx)\n", rt, CNTV_CTL_EL0);
+              xregs[rt] = timer.ctl();
+              LOG_CPU("mrs x%d, CNTV_CTL_EL0(=0x%lx)\n", rt, xregs[rt]);
+            } else {
+              timer.set_ctl(xregs[rt]);
+              LOG_CPU("msr CNTV_CTL_EL0(=0x%lx), x%d, \n", xregs[rt], rt);
+            }
+            return;
+          case 2:
+            if (if_get) {
+              xregs[rt] = timer.cval();
+              LOG_CPU("mrs x%d, CNTV_CVAL_EL0(=0x%lx)\n", rt, xregs[rt]);
             } else {
-              CNTV_CTL_EL0 = xregs[rt];
-              LOG_CPU("msr CNTV_CTL_EL0(=0x%lx), x%d, \n", CNTV_CTL_EL0, rt);
+              timer.set_cval(xregs[rt]);
+              LOG_CPU("msr CNTV_CVAL_EL0, x%d(=0x%lx)\n", rt, xregs[rt]);
             }
             return;
           default:
@@ -2753,14 +2905,14 @@ void Cpu::decode_system_register_move(uint32_t inst) {
 */
 
 void Cpu::decode_system_instructions(uint32_t inst) {
-  uint8_t l, op1, crn, crm, op2 /*, rt*/;
+  uint8_t l, op1, crn, crm, op2, rt;
 
   l = util::bit(inst, 21);
   op1 = util::shift(inst, 16, 18);
   crn = util::shift(inst, 12, 15);
   crm = util::shift(inst, 8, 11);
   op2 = util::shift(inst, 5, 7);
-  // rt = util::shift(inst, 0, 4);
+  rt = util::shift(inst, 0, 4);
 
   /* SYSL */
   if (l) {
@@ -2771,6 +2923,17 @@ void Cpu::decode_system_instructions(uint32_t inst) {
   /* SYS */
   if ((op1 == 0b000) && (crn == 0b1000) && (crm == 0b0011) && (op2 == 0b000)) {
     LOG_CPU("tlbi vmalle1is\n");
+  } else if ((op1 == 0b000) && (crn == 0b0111) &&
+             ((crm == 0b0001) || (crm == 0b0101)) && (op2 == 0b000)) {
+    /* IC IALLUIS, IC IALLU */
+    LOG_CPU("ic iallu%s\n", (crm == 0b0001) ? "is" : "");
+    bus.mem.invalidate_all_code();
+  } else if ((op1 == 0b011) && (crn == 0b0111) && (crm == 0b0101) &&
+             (op2 == 0b001)) {
+    /* IC IVAU */
+    uint64_t paddr = mmu.mmu_translate(xregs[rt]);
+    LOG_CPU("ic ivau, x%d(=0x%lx)\n", rt, xregs[rt]);
+    bus.mem.invalidate_code(paddr & ~(GUEST_PAGE_SIZE - 1), GUEST_PAGE_SIZE);
   } else {
     unsupported();
   }
@@ -2855,12 +3018,7 @@ void Cpu::decode_unconditional_branch_reg(uint32_t inst) {
     break;
   case 4:
     if ((op3 == 0) & (Rn == 31) & (op4 == 0)) {
-      SP_EL1 = sp;
-      set_pc(ELR_EL1);
-      if (((SPSR_EL1 & 7) == 0) || (util::bit(pc, 63) == 0)) {
-        el = 0;
-        sp = SP_EL0;
-      }
+      exception_return();
       LOG_CPU("eret to 0x%lx, sp=0x%lx, SP_EL1=0x%lx, SP_EL0=0x%lx, pc=0x%lx\n",
               ELR_EL1, sp, SP_EL1, SP_EL0, pc);
     }
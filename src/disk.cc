@@ -0,0 +1,173 @@
+#include "disk.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "cached_disk.h"
+#include "log.h"
+#include "overlay.h"
+#include "utils.h"
+
+std::unique_ptr<Disk> open_disk(const DiskOptions &options) {
+  if (!options.overlay.empty()) {
+    return std::make_unique<OverlayDisk>(options.filename, options.overlay);
+  }
+  if (options.cache_size) {
+    return std::make_unique<CachedDisk>(options.filename, options.mode,
+                                        options.cache_size);
+  }
+  return std::make_unique<MmapDisk>(options.filename, options.mode);
+}
+
+MmapDisk::MmapDisk(const std::string &filename, DiskMode mode) : mode_(mode) {
+  bool shared = (mode == DiskMode::Shared);
+  struct stat sb;
+
+  fd_ = open(filename.c_str(),
+             (mode == DiskMode::Private) ? O_RDONLY : O_RDWR);
+  if (fd_ < 0) {
+    std::cerr << "Cannot open file " << filename << std::endl;
+    exit(0);
+  }
+  if ((fstat(fd_, &sb) < 0) || (sb.st_size == 0)) {
+    std::cerr << "Cannot use empty disk image " << filename << std::endl;
+    exit(0);
+  }
+  size_ = sb.st_size;
+
+  // A private mapping gives copy-on-write pages, so the image file is never
+  // modified in Private mode, and only by write_back() in Writeback mode.
+  data_ = (uint8_t *)mmap(NULL, size_, PROT_READ | PROT_WRITE,
+                          shared ? MAP_SHARED : (MAP_PRIVATE | MAP_NORESERVE),
+                          fd_, 0);
+  if (data_ == (uint8_t *)-1) {
+    perror("mmap");
+    exit(1);
+  }
+  if (mode == DiskMode::Writeback) {
+    uint64_t sectors = (size_ + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    dirty_ = std::vector<std::atomic<uint64_t>>((sectors + 63) / 64);
+  }
+  LOG_SYSTEM("disk: %s, size: 0x%lx, mode: %s\n", filename.c_str(), size_,
+             shared                          ? "shared"
+             : (mode == DiskMode::Writeback) ? "writeback"
+                                             : "private");
+}
+
+MmapDisk::~MmapDisk() {
+  flush();
+  munmap(data_, size_);
+  close(fd_);
+}
+
+bool MmapDisk::read(uint64_t offset, uint8_t *dst, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  memcpy(dst, data_ + offset, len);
+  return true;
+}
+
+bool MmapDisk::write(uint64_t offset, const uint8_t *src, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  memcpy(data_ + offset, src, len);
+  if (mode_ == DiskMode::Writeback) {
+    mark_dirty(offset, len);
+  }
+  return true;
+}
+
+void MmapDisk::mark_dirty(uint64_t offset, uint64_t len) {
+  if (!len) {
+    return;
+  }
+  uint64_t first = offset / SECTOR_SIZE;
+  uint64_t last = (offset + len - 1) / SECTOR_SIZE;
+  for (uint64_t sector = first; sector <= last; sector++) {
+    dirty_[sector / 64].fetch_or(uint64_t(1) << (sector % 64),
+                                 std::memory_order_relaxed);
+  }
+}
+
+// Copy the dirty sectors to the image file, one pwrite per run of adjacent
+// dirty sectors.
+// A sector written concurrently is either copied now or stays dirty for the
+// next flush, since its bit is set after the data. Sectors that fail to
+// write or sync are marked dirty again.
+bool MmapDisk::write_back() {
+  std::vector<std::pair<uint64_t, uint64_t>> written;
+  uint64_t bytes = 0;
+  uint64_t run_start = 0;
+  bool in_run = false;
+  bool ok = true;
+
+  auto write_extent = [&](uint64_t first, uint64_t end) {
+    uint64_t offset = first * SECTOR_SIZE;
+    uint64_t len = std::min<uint64_t>(end * SECTOR_SIZE, size_) - offset;
+    if (!util::pwrite_full(fd_, data_ + offset, len, offset)) {
+      perror("pwrite");
+      mark_dirty(offset, len);
+      ok = false;
+      return;
+    }
+    written.emplace_back(offset, len);
+    bytes += len;
+  };
+
+  // One extra round with an empty word ends a run reaching the last sector.
+  for (uint64_t i = 0; i <= dirty_.size(); i++) {
+    uint64_t word = 0;
+    if (i < dirty_.size()) {
+      word = dirty_[i].exchange(0, std::memory_order_acquire);
+    }
+    if (word == (in_run ? ~uint64_t(0) : 0)) {
+      // the run goes on, or there is none
+      continue;
+    }
+    for (uint64_t bit = 0; bit < 64; bit++) {
+      bool dirty = (word >> bit) & 1;
+      if (dirty && !in_run) {
+        run_start = i * 64 + bit;
+        in_run = true;
+      } else if (!dirty && in_run) {
+        write_extent(run_start, i * 64 + bit);
+        in_run = false;
+      }
+    }
+  }
+  if (!written.empty()) {
+    if (fdatasync(fd_) < 0) {
+      perror("fdatasync");
+      for (const auto &extent : written) {
+        mark_dirty(extent.first, extent.second);
+      }
+      return false;
+    }
+    LOG_SYSTEM("disk: wrote back 0x%lx bytes in %ld extents\n", bytes,
+               written.size());
+  }
+  return ok;
+}
+
+bool MmapDisk::flush() {
+  if (mode_ == DiskMode::Writeback) {
+    return write_back();
+  }
+  if (mode_ == DiskMode::Shared) {
+    if (msync(data_, size_, MS_SYNC) < 0) {
+      perror("msync");
+      return false;
+    }
+  }
+  return true;
+}
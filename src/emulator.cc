@@ -5,24 +5,22 @@
 #include <memory>
 #include <string>
 
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <thread>
 #include <unistd.h>
 
 #include "cpu.h"
 #include "loader.h"
 #include "log.h"
 #include "mem.h"
+#include "overlay.h"
 #include "utils.h"
 
-int log_system_on = 0;
-int log_cpu_on = 0;
-int log_debug_on = 0;
-
-Emulator::Emulator(int argc, char **argv, char **envp, const std::string &disk)
-    : loader(argc, argv, envp), filename_(argv[1]) {
+Emulator::Emulator(const EmulatorOptions &options)
+    : loader(options.filename, options.ram_size), options_(options) {
 
   LOG_SYSTEM("emu: start emulating\n");
 
@@ -41,32 +39,24 @@ Emulator::Emulator(int argc, char **argv, char **envp, const std::string &disk)
   LOG_SYSTEM("loader.text_start = 0x%lx\n", loader.text_start_paddr);
   LOG_SYSTEM("loader.text_size = 0x%lx\n", loader.text_size);
   LOG_SYSTEM("loader.map_base = 0x%lx\n", loader.map_base);
+  LOG_SYSTEM("loader.ram_size = 0x%lx\n", loader.ram_size);
 
   // Create CPU
   cpu = std::make_unique<Cpu>(loader.entry, loader.init_sp,
                               loader.text_start_paddr, loader.text_size,
-                              loader.map_base, disk);
+                              loader.map_base, loader.ram_size,
+                              options_.disk, options_.uart,
+                              options_.timer);
 
   init_done_ = true;
   return;
 }
 
-// This function is executed in another thread for uart input
-void read_stdin(uint8_t *uart_rx_buff, uint8_t *uart_rx_idx) {
-  while (1) {
-    uint8_t idx = (*uart_rx_idx) % UART_RX_BUFF_LEN;
-    char *buff = (char *)uart_rx_buff + idx;
-    if (!fgets(buff, 10, stdin)) {
-      break;
-    }
-    for (uint8_t i = 0; i < 10; i++) {
-      *uart_rx_idx = *uart_rx_idx + 1;
-      if (*(buff + i) == '\n') {
-        break;
-      }
-    }
-  }
-}
+// Set by SIGINT/SIGTERM to leave execute_loop() and shut down cleanly, e.g.
+// to write back the disk.
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) { stop_requested = 1; }
 
 void Emulator::log_pc(uint64_t pc, const char *msg, uint64_t idx) {
   if (cpu->pc == pc) {
@@ -79,11 +69,13 @@ void Emulator::execute_loop() {
   uint32_t inst;
   int i = 0;
 
-  std::thread read_stdin_thread(read_stdin, cpu->bus.uart.uart_rx_buff,
-                                &cpu->bus.uart.uart_rx_idx);
+  cpu->bus.uart.start_input(STDIN_FILENO);
+
+  signal(SIGINT, request_stop);
+  signal(SIGTERM, request_stop);
 
-  while (true) {
-    cpu->timer_count += 1;
+  while (!stop_requested) {
+    cpu->icount += 1;
     cpu->check_interrupt();
 
     inst = cpu->fetch();
@@ -126,18 +118,205 @@ void Emulator::execute_loop() {
     }
     */
   }
-  munmap((void *)loader.map_base, RAM_SIZE);
+  // Stop the I/O threads before guest RAM goes away.
+  cpu->bus.uart.shutdown();
+  cpu->bus.virtio.shutdown();
+  munmap((void *)loader.map_base, loader.ram_size);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] <kernel filename>\n"
+          "  --mem <size>    guest RAM size, K/M/G suffix (default: 128M,\n"
+          "                  a plain number is in megabytes)\n"
+          "  --disk <file>   virtio-blk disk image (default: fs.img)\n"
+          "  --disk-mode <shared|private|writeback>\n"
+          "                  shared writes guest changes back to the image,\n"
+          "                  private discards them at exit (default),\n"
+          "                  writeback writes the changed sectors back on\n"
+          "                  flush requests and at exit\n"
+          "  --overlay <file>\n"
+          "                  keep guest writes in a copy-on-write overlay\n"
+          "                  file; the --disk image is only read\n"
+          "  --commit        merge the --overlay file into the --disk image\n"
+          "                  and exit\n"
+          "  --disk-cache <size>\n"
+          "                  read the image on demand through a block cache\n"
+          "                  of this size, K/M/G suffix, instead of mapping\n"
+          "                  it (default: 0, mapped)\n"
+          "  --disk-threads <n>\n"
+          "                  host I/O threads serving virtio-blk requests,\n"
+          "                  0 serves them on the CPU thread (default: 0)\n"
+          "  --disk-queues <n>\n"
+          "                  number of virtio-blk queues (default: 1)\n"
+          "  --virtio-version <1|2>\n"
+          "                  virtio-mmio interface, 1 is legacy (default: 1)\n"
+          "  --uart-rx-buffer <size>\n"
+          "                  console input buffer, K/M suffix, input is held\n"
+          "                  back while it is full (default: 4K)\n"
+          "  --uart-unbuffered\n"
+          "                  write console output a character at a time\n"
+          "                  instead of a line at a time\n"
+          "  --clock <host|icount>\n"
+          "                  generic timer counter source, host monotonic\n"
+          "                  time or one tick per instruction for\n"
+          "                  deterministic runs (default: host)\n"
+          "  --warp          when the guest idles waiting for its timer or\n"
+          "                  another timed event, jump the counter to it\n"
+          "                  instead of sleeping\n",
+          prog);
 }
 
-int main(int argc, char **argv, char **envp) {
-  if (argc < 2) {
-    LOG_SYSTEM("usage: %s <kernel filename>\n", argv[0]);
+int main(int argc, char **argv) {
+  EmulatorOptions options;
+  bool commit = false;
+  const struct option long_options[] = {
+      {"mem", required_argument, NULL, 'm'},
+      {"disk", required_argument, NULL, 'd'},
+      {"disk-mode", required_argument, NULL, 'D'},
+      {"overlay", required_argument, NULL, 'o'},
+      {"commit", no_argument, NULL, 'c'},
+      {"disk-cache", required_argument, NULL, 'C'},
+      {"disk-threads", required_argument, NULL, 'T'},
+      {"disk-queues", required_argument, NULL, 'Q'},
+      {"virtio-version", required_argument, NULL, 'V'},
+      {"uart-rx-buffer", required_argument, NULL, 'U'},
+      {"uart-unbuffered", no_argument, NULL, 'u'},
+      {"clock", required_argument, NULL, 'k'},
+      {"warp", no_argument, NULL, 'w'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "m:d:D:o:cC:T:Q:V:U:uk:wh",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'm':
+      if (!util::parse_size(optarg, 1024 * 1024, &options.ram_size) ||
+          (options.ram_size == 0) || (options.ram_size % PAGE_SIZE)) {
+        fprintf(stderr, "invalid memory size: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'd':
+      options.disk.filename = optarg;
+      break;
+    case 'D':
+      if (!strcmp(optarg, "shared")) {
+        options.disk.mode = DiskMode::Shared;
+      } else if (!strcmp(optarg, "private")) {
+        options.disk.mode = DiskMode::Private;
+      } else if (!strcmp(optarg, "writeback")) {
+        options.disk.mode = DiskMode::Writeback;
+      } else {
+        fprintf(stderr, "invalid disk mode: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'o':
+      options.disk.overlay = optarg;
+      break;
+    case 'c':
+      commit = true;
+      break;
+    case 'C':
+      if (!util::parse_size(optarg, 1024 * 1024, &options.disk.cache_size)) {
+        fprintf(stderr, "invalid disk cache size: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'T': {
+      char *end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if ((*optarg == '\0') || (*end != '\0') || (n > MAX_IO_THREADS)) {
+        fprintf(stderr, "invalid number of disk threads: %s\n", optarg);
+        return 1;
+      }
+      options.disk.io_threads = n;
+      break;
+    }
+    case 'Q': {
+      char *end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if ((*optarg == '\0') || (*end != '\0') || (n == 0) ||
+          (n > MAX_VIRTQUEUES)) {
+        fprintf(stderr, "invalid number of disk queues: %s\n", optarg);
+        return 1;
+      }
+      options.disk.num_queues = n;
+      break;
+    }
+    case 'V':
+      if (!strcmp(optarg, "1")) {
+        options.disk.virtio_version = 1;
+      } else if (!strcmp(optarg, "2")) {
+        options.disk.virtio_version = 2;
+      } else {
+        fprintf(stderr, "invalid virtio version: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'U': {
+      uint64_t size;
+      if (!util::parse_size(optarg, 1, &size) || (size == 0) ||
+          (size > 1024 * 1024 * 1024)) {
+        fprintf(stderr, "invalid uart rx buffer size: %s\n", optarg);
+        return 1;
+      }
+      options.uart.rx_buffer_size = size;
+      break;
+    }
+    case 'u':
+      options.uart.tx_unbuffered = true;
+      break;
+    case 'k':
+      if (!strcmp(optarg, "host")) {
+        options.timer.clock = TimerClock::Host;
+      } else if (!strcmp(optarg, "icount")) {
+        options.timer.clock = TimerClock::Icount;
+      } else {
+        fprintf(stderr, "invalid clock: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'w':
+      options.timer.warp = true;
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (!options.disk.overlay.empty() && options.disk.cache_size) {
+    fprintf(stderr, "--disk-cache cannot be used with --overlay\n");
+    return 1;
+  }
+  if (commit) {
+    if (options.disk.overlay.empty()) {
+      fprintf(stderr, "--commit needs --overlay\n");
+      return 1;
+    }
+    return commit_overlay(options.disk.overlay, options.disk.filename) < 0;
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
     return 0;
   }
+  options.filename = argv[optind];
 
-  const std::string diskname = "fs.img";
+  // The UART writes to stdout through stdio, which does the batching: one
+  // write per line, or per UART_TX_BUFF_LEN bytes, and exit() flushes
+  // whatever is left even on error paths. setvbuf() must come before any
+  // output, including the logs of the setup below.
+  if (options.uart.tx_unbuffered) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+  } else {
+    setvbuf(stdout, NULL, _IOLBF, UART_TX_BUFF_LEN);
+  }
 
-  Emulator emu(argc, argv, envp, diskname);
+  Emulator emu(options);
   if (emu.init_done_) {
     emu.execute_loop();
   }
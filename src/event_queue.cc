@@ -0,0 +1,86 @@
+#include "event_queue.h"
+
+#include <cassert>
+
+void EventQueue::init(Wakeup *wakeup) {
+  assert(wakeup);
+  wakeup_ = wakeup;
+}
+
+void EventQueue::set_clock(Clock *clock) {
+  assert(clock);
+  clock_ = clock;
+}
+
+void EventQueue::schedule(Event &event, uint64_t when) {
+  event.generation_++;
+  event.scheduled_ = true;
+  heap_.push({when, event.generation_, &event});
+  // Lower next() unless a post() has already pulled it down to 0.
+  uint64_t check = clock_->check_point(when);
+  uint64_t next = next_.load(std::memory_order_relaxed);
+  while ((check < next) && !next_.compare_exchange_weak(next, check)) {
+  }
+}
+
+void EventQueue::cancel(Event &event) {
+  if (event.scheduled_) {
+    event.generation_++;
+    event.scheduled_ = false;
+  }
+}
+
+void EventQueue::add_async(Event &event) { async_.push_back(&event); }
+
+void EventQueue::post(Event &event) {
+  event.posted_.store(true, std::memory_order_seq_cst);
+  next_.store(0, std::memory_order_seq_cst);
+  wakeup_->ring();
+}
+
+void EventQueue::run_posted() {
+  for (Event *event : async_) {
+    if (event->posted_.exchange(false, std::memory_order_acquire)) {
+      event->fn_();
+    }
+  }
+}
+
+void EventQueue::run() {
+  run_posted();
+  uint64_t now = clock_->now();
+  while (!heap_.empty() && (heap_.top().when <= now)) {
+    Entry entry = heap_.top();
+    heap_.pop();
+    if (entry.generation != entry.event->generation_) {
+      // cancelled or scheduled again since
+      continue;
+    }
+    entry.event->scheduled_ = false;
+    entry.event->fn_();
+  }
+  update_next();
+}
+
+uint64_t EventQueue::deadline() {
+  while (!heap_.empty() &&
+         (heap_.top().generation != heap_.top().event->generation_)) {
+    heap_.pop();
+  }
+  return heap_.empty() ? UINT64_MAX : heap_.top().when;
+}
+
+// Set next() to the check point of the earliest timed event. A post() racing
+// with this either stores 0 after it or its flag is seen here, so it is never
+// lost.
+void EventQueue::update_next() {
+  uint64_t when = deadline();
+  next_.store((when == UINT64_MAX) ? UINT64_MAX : clock_->check_point(when),
+              std::memory_order_seq_cst);
+  for (Event *event : async_) {
+    if (event->posted_.load(std::memory_order_seq_cst)) {
+      next_.store(0, std::memory_order_relaxed);
+      break;
+    }
+  }
+}
@@ -1,105 +1,415 @@
 #include "gic.h"
 
+#include <algorithm>
 #include <cassert>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "log.h"
 
+Gic::Gic() {
+  // Every SPI goes to CPU 0 until the guest routes it.
+  for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++) {
+    for (uint32_t w = 0; w < GIC_NR_WORDS; w++) {
+      routed_[cpu][w] = (cpu == 0) ? ~0u : 0;
+    }
+  }
+}
+
+void Gic::set_wakeup(uint32_t cpu, Wakeup *wakeup) {
+  assert(cpu < NR_CPUS);
+  cpus_[cpu].wakeup = wakeup;
+}
+
+void Gic::set_level(uint32_t irq, bool level, uint32_t cpu) {
+  assert((irq < GIC_NR_IRQS) && (cpu < NR_CPUS));
+  std::lock_guard<std::mutex> lock(mutex_);
+  GicIrqState &s = state(irq, cpu);
+  uint32_t w = irq / 32;
+  uint32_t bit = 1u << (irq % 32);
+  if (((s.level[w] & bit) != 0) == level) {
+    return;
+  }
+  if (level) {
+    s.level[w] |= bit;
+    s.pending[w] |= bit;
+  } else {
+    s.level[w] &= ~bit;
+    s.pending[w] &= ~bit;
+  }
+  update();
+}
+
+void Gic::raise(uint32_t irq, uint32_t cpu) {
+  assert((irq < GIC_NR_IRQS) && (cpu < NR_CPUS));
+  std::lock_guard<std::mutex> lock(mutex_);
+  state(irq, cpu).pending[irq / 32] |= 1u << (irq % 32);
+  update();
+}
+
+// Highest priority interrupt that is pending, enabled, not active and routed
+// to cpu, or GIC_SPURIOUS. Ties go to the lowest INTID.
+uint32_t Gic::highest_pending(uint32_t cpu) const {
+  const GicIrqState &banked = cpus_[cpu].irqs;
+  uint32_t best = GIC_SPURIOUS;
+  uint32_t best_priority = GIC_IDLE_PRIORITY;
+  for (uint32_t w = 0; w < GIC_NR_WORDS; w++) {
+    uint32_t bits;
+    if (w == 0) {
+      bits = banked.pending[0] & banked.enabled[0] & ~banked.active[0];
+    } else {
+      bits = dist_.pending[w] & dist_.enabled[w] & ~dist_.active[w] &
+             routed_[cpu][w];
+    }
+    while (bits) {
+      uint32_t irq = w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      if (priority(irq, cpu) < best_priority) {
+        best = irq;
+        best_priority = priority(irq, cpu);
+      }
+    }
+  }
+  return best;
+}
+
+uint32_t Gic::running_priority(uint32_t cpu) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return current_priority(cpu);
+}
+
+// Priority of the highest priority interrupt cpu is handling.
+uint32_t Gic::current_priority(uint32_t cpu) const {
+  uint32_t running = GIC_IDLE_PRIORITY;
+  for (uint32_t w = 0; w < GIC_NR_WORDS; w++) {
+    uint32_t bits = cpus_[cpu].acked[w];
+    while (bits) {
+      uint32_t irq = w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      running = std::min<uint32_t>(running, priority(irq, cpu));
+    }
+  }
+  return running;
+}
+
+// Whether irq may be signalled to cpu: forwarded by the distributor, group 1
+// enabled at the CPU interface, above the priority mask and able to preempt
+// the running priority.
+bool Gic::can_signal(uint32_t cpu, uint32_t irq) const {
+  const GicCpu &c = cpus_[cpu];
+  return (irq != GIC_SPURIOUS) &&
+         (d_ctlr & (GICD_CTLR_ENABLE_GRP0 | GICD_CTLR_ENABLE_GRP1)) &&
+         (c.igrpen1 & 1) && (priority(irq, cpu) < c.pmr) &&
+         (priority(irq, cpu) < current_priority(cpu));
+}
+
+// Recompute the IRQ signal of every CPU after a state change, and wake the
+// CPUs it was raised for.
+void Gic::update() {
+  for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++) {
+    GicCpu &c = cpus_[cpu];
+    bool line = can_signal(cpu, highest_pending(cpu));
+    if (!c.irq_line.exchange(line, std::memory_order_release) && line &&
+        c.wakeup) {
+      c.wakeup->ring();
+    }
+  }
+}
+
+void Gic::take_sgis(uint32_t cpu) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  GicCpu &c = cpus_[cpu];
+  c.irqs.pending[0] |= c.incoming_sgis.exchange(0, std::memory_order_acquire);
+  update();
+}
+
+// ICC_SGI1R_EL1: INTID in bits 27:24, IRM in bit 40 (every CPU but self),
+// otherwise TargetList in bits 15:0 for Aff3.Aff2.Aff1 = 0.
+void Gic::send_sgi(uint32_t self, uint64_t value) {
+  uint32_t bit = 1u << ((value >> 24) & 0xf);
+  bool broadcast = (value >> 40) & 1;
+  uint64_t aff321 = value & 0x00ff00ff00ff0000;
+  for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++) {
+    bool target = broadcast ? (cpu != self)
+                            : (!aff321 && ((value >> cpu) & 1));
+    if (target) {
+      cpus_[cpu].incoming_sgis.fetch_or(bit, std::memory_order_release);
+      if (cpus_[cpu].wakeup) {
+        cpus_[cpu].wakeup->ring();
+      }
+    }
+  }
+  LOG_CPU("gic: cpu %d sends SGI 0x%lx\n", self, value);
+}
+
+// ICC_IAR1_EL1: the interrupt becomes active. An edge-triggered one stops
+// being pending; a level-sensitive one stays pending while its line is
+// asserted and is signalled again after EOI.
+uint32_t Gic::acknowledge(uint32_t cpu) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t irq = highest_pending(cpu);
+  if (!can_signal(cpu, irq)) {
+    return GIC_SPURIOUS;
+  }
+  GicIrqState &s = state(irq, cpu);
+  uint32_t w = irq / 32;
+  uint32_t bit = 1u << (irq % 32);
+  s.active[w] |= bit;
+  s.pending[w] &= ~bit | s.level[w];
+  cpus_[cpu].acked[w] |= bit;
+  update();
+  LOG_CPU("gic: cpu %d acknowledges %d\n", cpu, irq);
+  return irq;
+}
+
+// ICC_EOIR1_EL1: priority drop and deactivation (EOImode 0)
+void Gic::end_of_interrupt(uint32_t cpu, uint32_t irq) {
+  if (irq >= GIC_NR_IRQS) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t bit = 1u << (irq % 32);
+  state(irq, cpu).active[irq / 32] &= ~bit;
+  cpus_[cpu].acked[irq / 32] &= ~bit;
+  update();
+}
+
+void Gic::set_pmr(uint32_t cpu, uint64_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cpus_[cpu].pmr = value & 0xff;
+  update();
+}
+
+void Gic::set_igrpen1(uint32_t cpu, uint64_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cpus_[cpu].igrpen1 = value & 1;
+  update();
+}
+
+// GICD_IROUTER<n>: Aff0 selects the CPU, Interrupt_Routing_Mode (bit 31)
+// picks CPU 0.
+void Gic::set_route(uint32_t irq, uint64_t value) {
+  irouter_[irq] = value;
+  uint32_t target = ((value >> 31) & 1) ? 0 : (value & 0xff);
+  if (target >= NR_CPUS) {
+    target = 0;
+  }
+  uint32_t bit = 1u << (irq % 32);
+  for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++) {
+    if (cpu == target) {
+      routed_[cpu][irq / 32] |= bit;
+    } else {
+      routed_[cpu][irq / 32] &= ~bit;
+    }
+  }
+  update();
+}
+
+// Registers laid out the same way in the distributor and in the SGI frame of
+// a redistributor, at offset from the frame base. Only INTIDs first_irq to
+// first_irq + nr_irqs - 1 are backed by s; the others are RAZ/WI.
+// Returns false if offset is not one of these registers.
+bool Gic::store_irq_reg(GicIrqState &s, uint64_t offset, uint32_t first_irq,
+                        uint32_t nr_irqs, uint64_t value) {
+  uint32_t bits = value;
+  if ((offset >= 0x080) && (offset < 0x400)) {
+    uint32_t w = (offset & 0x7f) / 4;
+    if ((w < first_irq / 32) || (w >= (first_irq + nr_irqs) / 32)) {
+      return true;
+    }
+    switch (offset & ~0x7f) {
+    case 0x080:
+      s.group[w] = bits;
+      break;
+    case 0x100:
+      s.enabled[w] |= bits;
+      break;
+    case 0x180:
+      s.enabled[w] &= ~bits;
+      break;
+    case 0x200:
+      s.pending[w] |= bits;
+      break;
+    case 0x280:
+      // A level-sensitive line still asserted stays pending.
+      s.pending[w] &= ~bits | s.level[w];
+      break;
+    case 0x300:
+      s.active[w] |= bits;
+      break;
+    case 0x380:
+      s.active[w] &= ~bits;
+      break;
+    }
+    update();
+    return true;
+  }
+  if ((offset >= 0x400) && (offset < 0x800)) {
+    uint32_t irq = offset - 0x400;
+    // Word accesses are aligned, anything else is taken as a byte access.
+    uint32_t len = (irq % 4) ? 1 : 4;
+    for (uint32_t i = irq; i < irq + len; i++, value >>= 8) {
+      if ((i >= first_irq) && (i < first_irq + nr_irqs)) {
+        s.priority[i] = value;
+      }
+    }
+    update();
+    return true;
+  }
+  if ((offset >= 0xc00) && (offset < 0xd00)) {
+    uint32_t w = (offset - 0xc00) / 4;
+    if ((w >= first_irq / 16) && (w < (first_irq + nr_irqs) / 16)) {
+      s.icfgr[w] = bits;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool Gic::load_irq_reg(const GicIrqState &s, uint64_t offset,
+                       uint32_t first_irq, uint32_t nr_irqs,
+                       uint64_t &value) {
+  value = 0;
+  if ((offset >= 0x080) && (offset < 0x400)) {
+    uint32_t w = (offset & 0x7f) / 4;
+    if ((w < first_irq / 32) || (w >= (first_irq + nr_irqs) / 32)) {
+      return true;
+    }
+    switch (offset & ~0x7f) {
+    case 0x080:
+      value = s.group[w];
+      break;
+    case 0x100:
+    case 0x180:
+      value = s.enabled[w];
+      break;
+    case 0x200:
+    case 0x280:
+      value = s.pending[w];
+      break;
+    case 0x300:
+    case 0x380:
+      value = s.active[w];
+      break;
+    }
+    return true;
+  }
+  if ((offset >= 0x400) && (offset < 0x800)) {
+    uint32_t irq = (offset - 0x400) & ~3;
+    for (uint32_t i = irq + 4; i-- > irq;) {
+      value <<= 8;
+      if ((i >= first_irq) && (i < first_irq + nr_irqs)) {
+        value |= s.priority[i];
+      }
+    }
+    return true;
+  }
+  if ((offset >= 0xc00) && (offset < 0xd00)) {
+    uint32_t w = (offset - 0xc00) / 4;
+    if ((w >= first_irq / 16) && (w < (first_irq + nr_irqs) / 16)) {
+      value = s.icfgr[w];
+    }
+    return true;
+  }
+  return false;
+}
+
+// Distributor registers, at offset from GIC_DIST, that hold INTIDs 0 to 31:
+// the first word of each bit array, IPRIORITYR0-7 and ICFGR0-1.
+static bool banked_sgi_ppi(uint64_t offset) {
+  return ((offset >= 0x080) && (offset < 0x400) && ((offset & 0x7f) < 4)) ||
+         ((offset >= 0x400) && (offset < 0x420)) ||
+         ((offset >= 0xc00) && (offset < 0xc08));
+}
+
 void Gic::store(uint64_t addr, uint64_t value) {
-  uint8_t irq;
+  std::lock_guard<std::mutex> lock(mutex_);
   if (addr == GICD_CTLR) {
     d_ctlr = value;
-  } else if (addr == GICD_TYPER) {
-    d_typer = value;
-  } else if ((addr >= GICD_IGROUPR) && (addr <= GICD_IGROUPR + 0x7f)) {
-    irq = (addr - GICD_IGROUPR) / 32;
-    assert(irq < 32);
-    d_igroupr[irq] = value;
-  } else if ((addr >= GICD_ISENABLER) && (addr <= GICD_ISENABLER + 0x7f)) {
-    irq = (addr - GICD_ISENABLER) / 32;
-    assert(irq < 32);
-    d_isenabler[irq] = value;
-  } else if ((addr >= GICD_ICPENDR) && (addr <= GICD_ICPENDR + 0x7f)) {
-    irq = (addr - GICD_ICPENDR) / 32;
-    assert(irq < 32);
-    d_icpendr[irq] = value;
-  } else if ((addr >= GICD_IPRIORITYR) && (addr <= GICD_IPRIORITYR + 0x3ff)) {
-    irq = addr - GICD_IPRIORITYR;
-    for (int i = irq; i < irq + 4; i++, value >>= 8) {
-      d_ipriorityr[i] = value;
-    }
+    update();
   } else if ((addr >= GICD_ITARGETSR) && (addr <= GICD_ITARGETSR + 0x3ff)) {
     // RAZ/WI
-  } else if (addr == GICR_CTLR) {
-    r_ctlr = value;
-  } else if (addr == GICR_WAKER) {
-    r_waker = value;
-  } else if (addr == GICR_IGROUPR0) {
-    r_igroupr0 = value;
-  } else if (addr == GICR_ISENABLER0) {
-    r_isenabler0 = value;
-  } else if (addr == GICR_ICPENDR0) {
-    r_icpendr0 = value;
-  } else if ((addr >= GICR_IPRIORITYR) && (addr <= GICR_IPRIORITYR + 0x1f)) {
-    int idx = (addr - GICR_IPRIORITYR) / 4;
-    assert(idx < 8);
-    r_ipriorityr[idx] = value;
-  } else if (addr == GICR_IGRPMODR0) {
-    r_igrpmodr0 = value;
+  } else if ((addr >= GICD_IROUTER + 32 * 8) &&
+             (addr < GICD_IROUTER + GIC_NR_IRQS * 8)) {
+    set_route((addr - GICD_IROUTER) / 8, value);
+  } else if ((addr >= GIC_DIST) && (addr < GIC_DIST + 0x10000)) {
+    // Without affinity routing the SGIs and PPIs of CPU 0 are banked here.
+    if (!(d_ctlr & GICD_CTLR_ARE) && banked_sgi_ppi(addr - GIC_DIST)) {
+      store_irq_reg(cpus_[0].irqs, addr - GIC_DIST, 0, 32, value);
+    } else if (!store_irq_reg(dist_, addr - GIC_DIST, 32, GIC_NR_IRQS - 32,
+                              value)) {
+      LOG_SYSTEM("gic unknown store 0x%lx\n", addr);
+    }
+  } else if ((addr >= GIC_REDIST) &&
+             (addr < GIC_REDIST + NR_CPUS * GICR_STRIDE)) {
+    GicCpu &c = cpus_[(addr - GIC_REDIST) / GICR_STRIDE];
+    uint64_t offset = (addr - GIC_REDIST) % GICR_STRIDE;
+    if (offset == GICR_CTLR) {
+      c.ctlr = value;
+    } else if (offset == GICR_WAKER) {
+      c.waker = value & 0x2;
+    } else if (offset == GICR_IGRPMODR0) {
+      c.igrpmodr0 = value;
+    } else if ((offset < GICR_SGI_FRAME) ||
+               !store_irq_reg(c.irqs, offset - GICR_SGI_FRAME, 0, 32,
+                              value)) {
+      LOG_SYSTEM("gic unknown store 0x%lx\n", addr);
+    }
   } else {
     LOG_SYSTEM("gic unknown store 0x%lx\n", addr);
   }
 }
 
 uint64_t Gic::load(uint64_t addr) {
-  uint8_t irq;
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t value;
   if (addr == GICD_CTLR) {
     return d_ctlr;
   } else if (addr == GICD_TYPER) {
     return d_typer;
-  } else if ((addr >= GICD_IGROUPR) && (addr <= GICD_IGROUPR + 0x7f)) {
-    irq = (addr - GICD_IGROUPR) / 32;
-    assert(irq < 32);
-    return d_igroupr[irq];
-  } else if ((addr >= GICD_ISENABLER) && (addr <= GICD_ISENABLER + 0x7f)) {
-    irq = (addr - GICD_ISENABLER) / 32;
-    assert(irq < 32);
-    return d_isenabler[irq];
-  } else if ((addr >= GICD_ICPENDR) && (addr <= GICD_ICPENDR + 0x7f)) {
-    irq = (addr - GICD_ICPENDR) / 32;
-    assert(irq < 32);
-    return d_icpendr[irq];
-  } else if ((addr >= GICD_IPRIORITYR) && (addr <= GICD_IPRIORITYR + 0x3ff)) {
-    irq = addr - GICD_IPRIORITYR;
-    uint32_t value = 0;
-    for (int i = irq + 3; i >= irq; i--) {
-      value <<= 8;
-      value |= d_ipriorityr[i];
-    }
-    return value;
   } else if ((addr >= GICD_ITARGETSR) && (addr <= GICD_ITARGETSR + 0x3ff)) {
     // RAZ/WI
     return 0;
-  } else if (addr == GICR_CTLR) {
-    return r_ctlr;
-  } else if (addr == GICR_WAKER) {
-    return r_waker;
-  } else if (addr == GICR_IGROUPR0) {
-    return r_igroupr0;
-  } else if (addr == GICR_ISENABLER0) {
-    return r_isenabler0;
-  } else if (addr == GICR_ICPENDR0) {
-    return r_icpendr0;
-  } else if ((addr >= GICR_IPRIORITYR) && (addr <= GICR_IPRIORITYR + 0x1f)) {
-    int idx = (addr - GICR_IPRIORITYR) / 4;
-    assert(idx < 8);
-    return r_ipriorityr[idx];
-  } else if (addr == GICR_IGRPMODR0) {
-    return r_igrpmodr0;
+  } else if ((addr >= GICD_IROUTER + 32 * 8) &&
+             (addr < GICD_IROUTER + GIC_NR_IRQS * 8)) {
+    return irouter_[(addr - GICD_IROUTER) / 8];
+  } else if ((addr >= GIC_DIST) && (addr < GIC_DIST + 0x10000)) {
+    if (!(d_ctlr & GICD_CTLR_ARE) && banked_sgi_ppi(addr - GIC_DIST)) {
+      load_irq_reg(cpus_[0].irqs, addr - GIC_DIST, 0, 32, value);
+      return value;
+    } else if (load_irq_reg(dist_, addr - GIC_DIST, 32, GIC_NR_IRQS - 32,
+                            value)) {
+      return value;
+    }
+    LOG_SYSTEM("gic unknown load 0x%lx\n", addr);
+    return 0;
+  } else if ((addr >= GIC_REDIST) &&
+             (addr < GIC_REDIST + NR_CPUS * GICR_STRIDE)) {
+    uint32_t cpu = (addr - GIC_REDIST) / GICR_STRIDE;
+    GicCpu &c = cpus_[cpu];
+    uint64_t offset = (addr - GIC_REDIST) % GICR_STRIDE;
+    uint64_t typer = ((uint64_t)cpu << 32) | (cpu << 8) |
+                     ((cpu == NR_CPUS - 1) ? GICR_TYPER_LAST : 0);
+    if (offset == GICR_CTLR) {
+      return c.ctlr;
+    } else if (offset == GICR_TYPER) {
+      return typer;
+    } else if (offset == GICR_TYPER + 4) {
+      return typer >> 32;
+    } else if (offset == GICR_WAKER) {
+      // ChildrenAsleep follows ProcessorSleep immediately.
+      return c.waker | ((c.waker & 0x2) << 1);
+    } else if (offset == GICR_IGRPMODR0) {
+      return c.igrpmodr0;
+    } else if ((offset >= GICR_SGI_FRAME) &&
+               load_irq_reg(c.irqs, offset - GICR_SGI_FRAME, 0, 32, value)) {
+      return value;
+    }
+    LOG_SYSTEM("gic unknown load 0x%lx\n", addr);
+    return 0;
   } else {
     LOG_SYSTEM("gic unknown load 0x%lx\n", addr);
 
     return 0;
   }
-}
\ No newline at end of file
+}
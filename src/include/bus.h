@@ -2,10 +2,12 @@
 
 #include <cstdint>
 
+#include "event_queue.h"
 #include "gic.h"
 #include "mem.h"
 #include "uart.h"
 #include "virtio.h"
+#include "wakeup.h"
 
 // GIC v3
 const uint64_t gicv3_base = 0x08000000;
@@ -20,8 +22,8 @@ const uint64_t virtio_mmio_base = 0x0a000000;
 const uint64_t virtio_mmio_size = 0x200;
 
 // RAM
+// The size is chosen at runtime (--mem) and kept in Mem::ram_size_.
 const uint64_t ram_base = 0x40000000;
-const uint64_t ram_size = 1024 * 1024 * 1024;
 
 enum class MemAccessSize {
   Byte,
@@ -40,13 +42,34 @@ const MemAccessSize memsz_tbl[] = {
 class Bus {
 public:
   Bus(uint64_t text_start, uint64_t text_size, uint64_t map_base,
-      const std::string &diskname);
+      uint64_t ram_size, const DiskOptions &disk_options,
+      const UartOptions &uart_options);
 
+  // Rung by device host threads to wake the vCPU from WFI/WFE
+  Wakeup wakeup;
+  EventQueue events;
   Mem mem;
   Uart uart;
   Gic gic;
   Virtio virtio;
 
-  uint64_t load(uint64_t address, MemAccessSize size);
-  void store(uint64_t address, uint64_t value, MemAccessSize size);
+  // RAM is checked first and handled inline; everything else is an MMIO
+  // access and goes through the out-of-line device dispatch.
+  template <typename T> T load(uint64_t address) {
+    if ((address >= ram_base) && (address < ram_base + mem.ram_size_)) {
+      return mem.load<T>(address);
+    }
+    return load_mmio(address);
+  }
+  template <typename T> void store(uint64_t address, T value) {
+    if ((address >= ram_base) && (address < ram_base + mem.ram_size_)) {
+      mem.store<T>(address, value);
+      return;
+    }
+    store_mmio(address, value);
+  }
+
+private:
+  uint64_t load_mmio(uint64_t address);
+  void store_mmio(uint64_t address, uint64_t value);
 };
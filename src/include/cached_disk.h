@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "disk.h"
+
+const uint64_t BLOCK_CACHE_BLOCK_SIZE = 64 * 1024;
+// Upper bound of the read-ahead window (1 MiB)
+const uint64_t MAX_READAHEAD_BLOCKS = 16;
+
+// Disk served with pread through an LRU cache of fixed-size blocks
+// Host memory use is bounded by the cache size rather than the image size, so
+// images much larger than RAM can be attached. Sequential reads grow a
+// read-ahead window that is fetched with a single preadv.
+//
+// Writes follow the disk mode: Shared writes through to the file, Writeback
+// keeps dirty blocks in the cache until they are evicted or flushed, and
+// Private keeps the written blocks in memory, outside of the cache.
+class CachedDisk : public Disk {
+public:
+  CachedDisk(const std::string &filename, DiskMode mode, uint64_t cache_size);
+  ~CachedDisk();
+  CachedDisk(const CachedDisk &) = delete;
+  CachedDisk &operator=(const CachedDisk &) = delete;
+
+  bool read(uint64_t offset, uint8_t *dst, uint64_t len) override;
+  bool write(uint64_t offset, const uint8_t *src, uint64_t len) override;
+  bool flush() override;
+
+private:
+  struct Block {
+    uint64_t index;
+    std::unique_ptr<uint8_t[]> data;
+    bool dirty;
+  };
+
+  int fd_;
+  DiskMode mode_;
+  // cache size in blocks
+  uint64_t capacity_;
+  // One lock for the cache. I/O threads only contend on it for the copy and
+  // on misses.
+  std::mutex mutex_;
+  // most recently used first
+  std::list<Block> lru_;
+  std::unordered_map<uint64_t, std::list<Block>::iterator> map_;
+  // Blocks written in Private mode. They cannot be dropped, so they are kept
+  // out of the cache.
+  std::unordered_map<uint64_t, std::unique_ptr<uint8_t[]>> private_;
+
+  // read-ahead state
+  uint64_t last_block_ = UINT64_MAX;
+  uint64_t readahead_ = 0;
+
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+
+  uint64_t block_len(uint64_t index) const;
+  Block *fetch(uint64_t index);
+  bool evict();
+  bool write_block(const Block &block);
+};
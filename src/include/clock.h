@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Source of the system counter
+enum class TimerClock {
+  // host monotonic time since start
+  Host,
+  // one tick per executed instruction, so runs are deterministic; time
+  // spent idle in WFI/WFE is added in real time
+  Icount,
+};
+
+// Timer configuration taken from the command line
+struct TimerOptions {
+  TimerClock clock = TimerClock::Host;
+  // When the CPU is idle and only waits for timed events, jump the counter
+  // to the next one instead of sleeping.
+  bool warp = false;
+};
+
+// CNTFRQ_EL0: 62.5MHz, one tick every 16ns
+const uint64_t TIMER_FREQ = 62500000;
+const uint64_t TIMER_NS_PER_TICK = 1000000000 / TIMER_FREQ;
+// With the host clock, instructions between two reads of it while an event
+// is pending
+const uint64_t TIMER_HOST_POLL = 1024;
+
+// Longest jump of the counter by --warp: one day
+const uint64_t TIMER_WARP_HORIZON = 24ull * 3600 * TIMER_FREQ;
+
+// The system counter (CNTPCT_EL0), which is the virtual time of the
+// emulator: the generic timer compares against it and device events are
+// scheduled on it.
+//
+// The CPU cannot read the host clock before every instruction, so it asks
+// check_point() for the instruction count at which a time may have been
+// reached. With the instruction clock that is exact; with the host clock it
+// is never late by more than TIMER_HOST_POLL instructions.
+class Clock {
+public:
+  Clock(const TimerOptions &options, const uint64_t *icount);
+
+  uint64_t now() const;
+
+  // Instruction count at which now() may have reached ticks.
+  uint64_t check_point(uint64_t ticks) const;
+  // Host time at which now() reaches ticks, saturated at time_point::max().
+  std::chrono::steady_clock::time_point host_time(uint64_t ticks) const;
+
+  // Account for time the CPU slept. The instruction clock does not move on
+  // its own, so the time is added to it, without going past limit.
+  void idle(std::chrono::nanoseconds slept, uint64_t limit);
+  // Advance the counter to ticks. Returns false if there is nothing to skip,
+  // or ticks is beyond TIMER_WARP_HORIZON and taken as "never".
+  bool warp_to(uint64_t ticks);
+  bool warp_enabled() const { return warp_; }
+
+private:
+  TimerClock source_;
+  bool warp_;
+  std::chrono::steady_clock::time_point start_;
+  // instructions executed by the CPU
+  const uint64_t *icount_;
+  // ticks the counter is ahead of its source: time slept with the
+  // instruction clock, and time warped over
+  uint64_t skipped_ticks_ = 0;
+};
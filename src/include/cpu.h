@@ -1,11 +1,23 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
 
 #include "bus.h"
 #include "log.h"
 #include "mmu.h"
+#include "timer.h"
+
+// Longest a vCPU sleeps in WFI/WFE before it looks at the emulator state
+// again, e.g. for a stop request.
+const std::chrono::milliseconds WFI_MAX_SLEEP(100);
+
+// PSTATE.DAIF
+const uint64_t DAIF_D = 1 << 9;
+const uint64_t DAIF_A = 1 << 8;
+const uint64_t DAIF_I = 1 << 7;
+const uint64_t DAIF_F = 1 << 6;
 
 struct NZCV {
   uint8_t V : 1;
@@ -17,21 +29,27 @@ struct NZCV {
 class Cpu {
 public:
   Cpu(uint64_t pc, uint64_t sp, uint64_t text_start, uint64_t text_size,
-      uint64_t map_base, const std::string &diskname);
+      uint64_t map_base, uint64_t ram_size, const DiskOptions &disk_options,
+      const UartOptions &uart_options, const TimerOptions &timer_options);
   Bus bus;
   MMU mmu;
+  Clock clock;
+  Timer timer;
   uint64_t pc;
 
   uint64_t xregs[32] = {0};
   uint64_t sp;
   const uint64_t xzr = 0;
   uint64_t CurrentEL;
-  const uint64_t mpidr_el1 = 0x80000000;
+  // Index of this vCPU in the GIC, also its affinity Aff0 in MPIDR_EL1
+  const uint32_t cpu_id = 0;
+  const uint64_t mpidr_el1 = 0x80000000 | cpu_id;
   uint64_t VBAR_EL1;
   uint64_t SP_EL0;
   uint64_t SP_EL1;
   uint64_t ESR_EL1;
-  uint64_t timer_count;
+  // instructions executed
+  uint64_t icount = 0;
 
   /* PSTATE */
   /*
@@ -60,27 +78,21 @@ public:
   uint8_t el = 1;
 
   // Interrupt
-  // Interrupt Controller Interrupt Group 1 Enable register
-  uint64_t ICC_IGRPEN1_EL1;
-  // Interrupt Controller Interrupt Priority Mask Register
-  uint64_t ICC_PMR_EL1;
+  // The other ICC_* registers are the CPU interface in bus.gic.
   // Interrupt Controller System Register Enable register (EL1)
   uint64_t ICC_SRE_EL1 = 0x7;
-  uint64_t ICC_IAR1_EL1;
-  uint64_t ICC_EOIR1_EL1;
   uint64_t SPSR_EL1;
   uint64_t ELR_EL1;
 
   // Timer
-  // Counter-timer Virtual Timer Control register
-  uint64_t CNTV_CTL_EL0 = 0;
+  // The counter and CNTV_* registers are in timer.
   // Counter-timer Frequency register
-  uint64_t CNTFRQ_EL0 = 0x3b9aca0;
-  // Counter-timer Virtual Timer TimerValue register
-  uint64_t CNTV_TVAL_EL0 = 0;
+  const uint64_t CNTFRQ_EL0 = TIMER_FREQ;
+
+  // Event register, set by SEV/SEVL and exception return, consumed by WFE
+  bool event_register = false;
 
   void check_interrupt();
-  void cause_interrupt(uint64_t irq);
   uint32_t fetch();
   void decode_start(uint32_t inst);
   void show_stack();
@@ -90,7 +102,19 @@ private:
   void increment_pc() { pc += 4; }
   void set_pc(uint64_t new_pc) { pc = new_pc; }
   bool check_b_flag(uint8_t cond, NZCV &nzcv);
-
+  uint64_t pstate() const;
+  void take_exception(uint64_t vector_offset);
+  void exception_return();
+  void wait_for_interrupt(bool wfe);
+
+  // Decoders that know the access size statically call load<T>/store<T>
+  // directly; the MemAccessSize overloads dispatch for table-driven sizes.
+  template <typename T> T load(uint64_t address) {
+    return bus.load<T>(mmu.mmu_translate(address));
+  }
+  template <typename T> void store(uint64_t address, T value) {
+    bus.store<T>(mmu.mmu_translate(address), value);
+  }
   uint64_t load(uint64_t address, MemAccessSize size);
   void store(uint64_t address, uint64_t value, MemAccessSize size);
 
@@ -146,6 +170,7 @@ private:
   void decode_system_instructions(uint32_t inst);
   void decode_pstate(uint32_t inst);
   void decode_barriers(uint32_t inst);
+  void decode_hints(uint32_t inst);
   void decode_unconditional_branch_reg(uint32_t inst);
   void decode_unconditional_branch_imm(uint32_t inst);
   void decode_compare_and_branch_imm(uint32_t inst);
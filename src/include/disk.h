@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class DiskMode {
+  // Guest writes go to the image file.
+  Shared,
+  // Guest writes stay in memory and are discarded at exit.
+  Private,
+  // Guest writes stay in memory; the written sectors are copied to the image
+  // file on flush requests and at exit.
+  Writeback,
+};
+
+const uint64_t SECTOR_SIZE = 512;
+
+const unsigned MAX_IO_THREADS = 64;
+const unsigned MAX_VIRTQUEUES = 16;
+
+// Block device configuration taken from the command line
+struct DiskOptions {
+  std::string filename = "fs.img";
+  DiskMode mode = DiskMode::Private;
+  // Number of host I/O worker threads. 0 handles requests synchronously on
+  // the vCPU thread.
+  unsigned io_threads = 0;
+  // Number of virtqueues. More than one offers VIRTIO_BLK_F_MQ.
+  unsigned num_queues = 1;
+  // virtio-mmio interface version: 1 (legacy) or 2
+  uint32_t virtio_version = 1;
+  // Copy-on-write delta file. If set, filename is opened read-only as the
+  // base image and guest writes go to the overlay; mode is ignored.
+  std::string overlay;
+  // Size of the block cache in bytes. If non-zero the image is read on demand
+  // with pread instead of being mmap'ed. Not used with an overlay.
+  uint64_t cache_size = 0;
+};
+
+// Block device backing store
+// Offsets and lengths are in bytes. The virtio-blk I/O threads call read() and
+// write() concurrently, so backends must be thread-safe for disjoint ranges.
+class Disk {
+public:
+  virtual ~Disk() = default;
+
+  uint64_t size() const { return size_; }
+
+  // Transfer len bytes at byte offset of the image.
+  // Return false if the range is out of the image or on I/O errors.
+  virtual bool read(uint64_t offset, uint8_t *dst, uint64_t len) = 0;
+  virtual bool write(uint64_t offset, const uint8_t *src, uint64_t len) = 0;
+
+  // Make guest writes durable. Return false if some did not reach the image;
+  // they are kept and tried again by the next flush.
+  virtual bool flush() = 0;
+
+protected:
+  uint64_t size_ = 0;
+};
+
+// Open the backend selected by options. Exits on errors.
+std::unique_ptr<Disk> open_disk(const DiskOptions &options);
+
+// The image file is mmap'ed, so startup does not depend on the image size and
+// pages are only read from the file when the guest accesses them.
+class MmapDisk : public Disk {
+public:
+  MmapDisk(const std::string &filename, DiskMode mode);
+  ~MmapDisk();
+  MmapDisk(const MmapDisk &) = delete;
+  MmapDisk &operator=(const MmapDisk &) = delete;
+
+  // A single memcpy each.
+  bool read(uint64_t offset, uint8_t *dst, uint64_t len) override;
+  bool write(uint64_t offset, const uint8_t *src, uint64_t len) override;
+
+  // Write back guest changes to the image file (Shared and Writeback modes).
+  bool flush() override;
+
+private:
+  int fd_;
+  uint8_t *data_;
+  DiskMode mode_;
+  // One bit per sector written since the last flush (Writeback mode only)
+  std::vector<std::atomic<uint64_t>> dirty_;
+
+  void mark_dirty(uint64_t offset, uint64_t len);
+  bool write_back();
+};
@@ -9,16 +9,25 @@
 #include "cpu.h"
 #include "loader.h"
 
+// Command line options
+struct EmulatorOptions {
+  const char *filename = nullptr;
+  DiskOptions disk;
+  UartOptions uart;
+  TimerOptions timer;
+  uint64_t ram_size = DEFAULT_RAM_SIZE;
+};
+
 class Emulator {
 public:
   std::unique_ptr<Cpu> cpu;
   Loader loader;
 
-  Emulator(int argc, char **argv, char **envp, const std::string &disk);
+  Emulator(const EmulatorOptions &options);
   void execute_loop();
   void log_pc(uint64_t addr, const char *msg, uint64_t idx);
   bool init_done_;
 
 private:
-  char *filename_;
+  EmulatorOptions options_;
 };
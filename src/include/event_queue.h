@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "clock.h"
+#include "wakeup.h"
+
+// Something a device wants done on the vCPU thread, either at a virtual time
+// (EventQueue::schedule) or as soon as possible after a host thread posts it
+// (EventQueue::post).
+class Event {
+public:
+  explicit Event(std::function<void()> fn) : fn_(std::move(fn)) {}
+  Event(const Event &) = delete;
+  Event &operator=(const Event &) = delete;
+
+  bool scheduled() const { return scheduled_; }
+
+private:
+  friend class EventQueue;
+  std::function<void()> fn_;
+  // bumped on every schedule and cancel, so stale heap entries are skipped
+  uint64_t generation_ = 0;
+  bool scheduled_ = false;
+  std::atomic<bool> posted_{false};
+};
+
+// Pending device and timer events of the vCPU, keyed on virtual time, the
+// system counter of clock. next() is the instruction count at which the
+// earliest one may be due, from Clock::check_point(). The CPU compares its
+// count with next() before every instruction and calls run() once it is
+// reached, so nothing is polled while no event is pending. An idle CPU
+// sleeps until deadline(), or warps to it.
+//
+// Timed events are kept in a min-heap and only touched by the vCPU thread.
+// Host threads post events registered with add_async(): post() sets the
+// event's flag and pulls next() down to 0, so the vCPU runs it before its
+// next instruction, or wakes from WFI to run it.
+class EventQueue {
+public:
+  void init(Wakeup *wakeup);
+  void set_clock(Clock *clock);
+
+  // vCPU thread
+  uint64_t now() const { return clock_->now(); }
+  void schedule(Event &event, uint64_t when);
+  void cancel(Event &event);
+  // Register an event that may be posted by another thread. Done before the
+  // host threads start.
+  void add_async(Event &event);
+  // Any thread
+  void post(Event &event);
+
+  uint64_t next() const { return next_.load(std::memory_order_relaxed); }
+  // Virtual time of the earliest timed event, or UINT64_MAX if none.
+  uint64_t deadline();
+  // Run every posted event and every event due now.
+  void run();
+
+private:
+  struct Entry {
+    uint64_t when;
+    uint64_t generation;
+    Event *event;
+    bool operator>(const Entry &other) const { return when > other.when; }
+  };
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap_;
+  std::vector<Event *> async_;
+  std::atomic<uint64_t> next_{UINT64_MAX};
+  Wakeup *wakeup_ = nullptr;
+  Clock *clock_ = nullptr;
+
+  void run_posted();
+  void update_next();
+};
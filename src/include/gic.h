@@ -1,47 +1,175 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <mutex>
+
+#include "wakeup.h"
 
 const uint64_t GIC_DIST = 0x08000000;
 const uint64_t GICD_CTLR = GIC_DIST + 0x0;
 const uint64_t GICD_TYPER = GIC_DIST + 0x4;
 const uint64_t GICD_IGROUPR = GIC_DIST + 0x80;
 const uint64_t GICD_ISENABLER = GIC_DIST + 0x100;
+const uint64_t GICD_ICENABLER = GIC_DIST + 0x180;
+const uint64_t GICD_ISPENDR = GIC_DIST + 0x200;
 const uint64_t GICD_ICPENDR = GIC_DIST + 0x280;
+const uint64_t GICD_ISACTIVER = GIC_DIST + 0x300;
+const uint64_t GICD_ICACTIVER = GIC_DIST + 0x380;
 const uint64_t GICD_IPRIORITYR = GIC_DIST + 0x400;
 const uint64_t GICD_ITARGETSR = GIC_DIST + 0x800;
+const uint64_t GICD_ICFGR = GIC_DIST + 0xc00;
+const uint64_t GICD_IROUTER = GIC_DIST + 0x6000;
 
+// One redistributor per CPU, each an RD_base frame followed by an SGI_base
+// frame. Register offsets below are from the start of a redistributor.
 const uint64_t GIC_REDIST = 0x080a0000;
-const uint64_t GICR_CTLR = GIC_REDIST + 0x0;
-const uint64_t GICR_WAKER = GIC_REDIST + 0x14;
+const uint64_t GICR_STRIDE = 0x20000;
+const uint64_t GICR_CTLR = 0x0;
+const uint64_t GICR_TYPER = 0x8;
+const uint64_t GICR_WAKER = 0x14;
+
+const uint64_t GICR_SGI_FRAME = 0x10000;
+const uint64_t GICR_IGROUPR0 = GICR_SGI_FRAME + 0x80;
+const uint64_t GICR_ISENABLER0 = GICR_SGI_FRAME + 0x100;
+const uint64_t GICR_ICENABLER0 = GICR_SGI_FRAME + 0x180;
+const uint64_t GICR_ISPENDR0 = GICR_SGI_FRAME + 0x200;
+const uint64_t GICR_ICPENDR0 = GICR_SGI_FRAME + 0x280;
+const uint64_t GICR_ISACTIVER0 = GICR_SGI_FRAME + 0x300;
+const uint64_t GICR_ICACTIVER0 = GICR_SGI_FRAME + 0x380;
+const uint64_t GICR_IPRIORITYR = GICR_SGI_FRAME + 0x400;
+const uint64_t GICR_ICFGR0 = GICR_SGI_FRAME + 0xc00;
+const uint64_t GICR_IGRPMODR0 = GICR_SGI_FRAME + 0xd00;
+
+// GICD_CTLR
+const uint32_t GICD_CTLR_ENABLE_GRP0 = 1 << 0;
+const uint32_t GICD_CTLR_ENABLE_GRP1 = 1 << 1;
+const uint32_t GICD_CTLR_ARE = 1 << 4;
+// GICR_TYPER: this is the last redistributor
+const uint64_t GICR_TYPER_LAST = 1 << 4;
+
+// Number of vCPUs, each with its redistributor and CPU interface. Affinity
+// is Aff0 = CPU number.
+const uint32_t NR_CPUS = 1;
+
+// GICD_TYPER.ITLinesNumber is 7: SGIs, PPIs and 224 SPIs
+const uint32_t GIC_NR_IRQS = 256;
+const uint32_t GIC_NR_WORDS = GIC_NR_IRQS / 32;
+// INTID read from ICC_IAR1_EL1 when nothing can be taken
+const uint32_t GIC_SPURIOUS = 1023;
+// Lowest priority; an idle CPU interface runs at it.
+const uint32_t GIC_IDLE_PRIORITY = 0x100;
+
+// Interrupt lines of the devices on the virt board
+const uint32_t GIC_PPI_VTIMER = 27;
+const uint32_t GIC_SPI_UART = 33;
+const uint32_t GIC_SPI_VIRTIO = 48;
+
+// Interrupt state as bitmaps of 32-bit words, one bit per INTID
+struct GicIrqState {
+  uint32_t group[GIC_NR_WORDS] = {0};
+  uint32_t enabled[GIC_NR_WORDS] = {0};
+  uint32_t pending[GIC_NR_WORDS] = {0};
+  uint32_t active[GIC_NR_WORDS] = {0};
+  // lines currently asserted by level-sensitive sources
+  uint32_t level[GIC_NR_WORDS] = {0};
+  uint32_t icfgr[GIC_NR_IRQS / 16] = {0};
+  uint8_t priority[GIC_NR_IRQS] = {0};
+};
 
-const uint64_t GIC_SGI_BASE = GIC_REDIST + 0x10000;
-const uint64_t GICR_IGROUPR0 = GIC_SGI_BASE + 0x80;
-const uint64_t GICR_ISENABLER0 = GIC_SGI_BASE + 0x100;
-const uint64_t GICR_ICPENDR0 = GIC_SGI_BASE + 0x280;
-const uint64_t GICR_IPRIORITYR = GIC_SGI_BASE + 0x400;
-const uint64_t GICR_IGRPMODR0 = GIC_SGI_BASE + 0xd00;
+// Redistributor and CPU interface of one CPU. Only word 0 of its state, the
+// SGIs and PPIs, is used.
+struct GicCpu {
+  GicIrqState irqs;
+  uint32_t ctlr = 0;
+  uint32_t waker = 0x6;
+  uint32_t igrpmodr0 = 0;
+  // SGIs sent to this CPU, merged into irqs.pending by its own thread
+  std::atomic<uint32_t> incoming_sgis{0};
 
+  uint64_t pmr = 0;
+  uint64_t igrpen1 = 0;
+  // interrupts acknowledged and not yet ended, for the running priority
+  uint32_t acked[GIC_NR_WORDS] = {0};
+  // written under the GIC lock by any CPU, read by this one without it
+  std::atomic<bool> irq_line{false};
+  // rung when irq_line rises or an SGI arrives
+  Wakeup *wakeup = nullptr;
+};
+
+// GICv3 distributor, redistributors and CPU interfaces
+// Pending, enabled and active state are bitmaps of 32-bit words, so finding
+// the interrupt to take is a ctz over the few non-zero masked words. Devices
+// drive their line with set_level() or raise(), and a CPU only has to test
+// irq_line() before each instruction.
+//
+// Every vCPU thread changes the distributor state, so it is guarded by
+// mutex_, except for the two words a CPU tests before each instruction:
+// irq_line, recomputed for every CPU by update(), and incoming_sgis. The
+// sender of an SGI sets bits in the target's incoming_sgis word and the
+// target merges them the next time it checks irq_line(), so sending an IPI
+// takes no lock. A CPU sleeping in WFI is rung when either changes.
 class Gic {
 public:
-  Gic() = default;
+  Gic();
   ~Gic() = default;
 
+  void set_wakeup(uint32_t cpu, Wakeup *wakeup);
+
   void store(uint64_t addr, uint64_t value);
   uint64_t load(uint64_t addr);
 
+  // Level-sensitive line: pending while asserted. cpu selects the
+  // redistributor for PPIs and is ignored for SPIs.
+  void set_level(uint32_t irq, bool level, uint32_t cpu = 0);
+  // Edge: pending until acknowledged.
+  void raise(uint32_t irq, uint32_t cpu = 0);
+
+  // The CPU interface signals an IRQ to the PE.
+  bool irq_line(uint32_t cpu) {
+    if (cpus_[cpu].incoming_sgis.load(std::memory_order_relaxed)) {
+      take_sgis(cpu);
+    }
+    return cpus_[cpu].irq_line.load(std::memory_order_acquire);
+  }
+
+  // CPU interface system registers
+  uint32_t acknowledge(uint32_t cpu);
+  void end_of_interrupt(uint32_t cpu, uint32_t irq);
+  uint64_t pmr(uint32_t cpu) const { return cpus_[cpu].pmr; }
+  void set_pmr(uint32_t cpu, uint64_t value);
+  uint64_t igrpen1(uint32_t cpu) const { return cpus_[cpu].igrpen1; }
+  void set_igrpen1(uint32_t cpu, uint64_t value);
+  uint32_t running_priority(uint32_t cpu);
+  // ICC_SGI1R_EL1 written by CPU self
+  void send_sgi(uint32_t self, uint64_t value);
+
 private:
-  uint32_t d_ctlr;
+  std::mutex mutex_;
+  uint32_t d_ctlr = 0;
   uint32_t d_typer = 0x3780007;
-  uint32_t d_igroupr[32] = {0};
-  uint32_t d_isenabler[32] = {0};
-  uint32_t d_icpendr[32] = {0};
-  uint8_t d_ipriorityr[1024] = {0};
-  uint32_t r_ctlr;
-  uint32_t r_waker = 0x2;
-  uint32_t r_igroupr0;
-  uint32_t r_isenabler0 = 0;
-  uint32_t r_icpendr0 = 0;
-  uint32_t r_ipriorityr[8] = {0};
-  uint32_t r_igrpmodr0;
-};
\ No newline at end of file
+  // SPIs; word 0 is banked in the redistributors.
+  GicIrqState dist_;
+  // SPIs routed to each CPU by GICD_IROUTER<n>
+  uint32_t routed_[NR_CPUS][GIC_NR_WORDS];
+  uint64_t irouter_[GIC_NR_IRQS] = {0};
+  GicCpu cpus_[NR_CPUS];
+
+  GicIrqState &state(uint32_t irq, uint32_t cpu) {
+    return (irq < 32) ? cpus_[cpu].irqs : dist_;
+  }
+  uint8_t priority(uint32_t irq, uint32_t cpu) const {
+    return (irq < 32) ? cpus_[cpu].irqs.priority[irq] : dist_.priority[irq];
+  }
+  // The helpers below are called with mutex_ held.
+  uint32_t highest_pending(uint32_t cpu) const;
+  uint32_t current_priority(uint32_t cpu) const;
+  bool can_signal(uint32_t cpu, uint32_t irq) const;
+  void update();
+  void take_sgis(uint32_t cpu);
+  void set_route(uint32_t irq, uint64_t value);
+  bool store_irq_reg(GicIrqState &s, uint64_t offset, uint32_t first_irq,
+                     uint32_t nr_irqs, uint64_t value);
+  bool load_irq_reg(const GicIrqState &s, uint64_t offset, uint32_t first_irq,
+                    uint32_t nr_irqs, uint64_t &value);
+};
@@ -7,7 +7,8 @@
 #include <unistd.h>
 
 const uint64_t STACK_SIZE = 1000 * 1000;
-const uint32_t RAM_SIZE = 128 * 1024 * 1024; // 128MB
+const uint64_t DEFAULT_RAM_SIZE = 128 * 1024 * 1024; // 128MB
+const uint64_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
 class Loader {
 public:
@@ -16,9 +17,10 @@ public:
   uint64_t map_base;
   uint64_t text_size;
   uint64_t sp_alloc_start; // for free
+  uint64_t ram_size;
   const uint64_t text_start_paddr = 0x40000000;
 
-  Loader(int argc, char **argv, char **envp);
+  Loader(const char *filename, uint64_t ram_size);
   ~Loader();
 
   int init();
@@ -26,10 +28,7 @@ public:
 
 private:
   int fd_; // for close
-  char *filename_;
-  int argc_;
-  char **argv_;
-  char **envp_;
+  const char *filename_;
   struct stat sb_;
   char *file_map_start_;
   Elf64_Ehdr *eh_;
@@ -39,4 +38,5 @@ private:
   bool use_paddr_;
 
   const char *get_interp() const;
+  int load_segment(const Elf64_Phdr *ph);
 };
@@ -1,6 +1,19 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+// Guest memory is accessed with host loads/stores, so the host must share the
+// guest's (little-endian) byte order.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "little-endian host required");
+
+// Granule of dirty page tracking, independent of the host page size.
+const uint64_t GUEST_PAGE_SHIFT = 12;
+const uint64_t GUEST_PAGE_SIZE = 1 << GUEST_PAGE_SHIFT;
 
 class Mem {
 public:
@@ -11,28 +24,103 @@ public:
   uint64_t text_start_;
   uint64_t text_size_;
   uint64_t map_base_;
+  uint64_t ram_size_;
 
   Mem() = default;
   ~Mem() = default;
 
-  void init(uint64_t text_start, uint64_t text_size, uint64_t map_base);
+  void init(uint64_t text_start, uint64_t text_size, uint64_t map_base,
+            uint64_t ram_size);
   void clean_mem();
-  uint64_t get_ptr(uint64_t vaddr);
+  uint64_t get_ptr(uint64_t paddr) { return paddr - text_start_ + map_base_; }
+  // Whether [paddr, paddr + len) lies entirely in RAM.
+  bool in_ram(uint64_t paddr, uint64_t len) const {
+    return (paddr >= text_start_) && (paddr - text_start_ <= ram_size_) &&
+           (len <= ram_size_ - (paddr - text_start_));
+  }
 
-  uint8_t load8(uint64_t addr);
-  uint16_t load16(uint64_t addr);
-  uint32_t load32(uint64_t addr);
-  uint64_t load64(uint64_t addr);
-  void store8(uint64_t addr, uint8_t value);
-  void store16(uint64_t addr, uint16_t value);
-  void store32(uint64_t addr, uint32_t value);
-  void store64(uint64_t addr, uint64_t value);
+  // Size-specialized accessors. T is one of uint8_t, uint16_t, uint32_t or
+  // uint64_t, so every access compiles down to a single host load/store.
+  template <typename T> T load(uint64_t addr) {
+    T value;
+    memcpy(&value, (void *)get_ptr(addr), sizeof(T));
+    return value;
+  }
+  template <typename T> void store(uint64_t addr, T value) {
+    memcpy((void *)get_ptr(addr), &value, sizeof(T));
+    mark_dirty(addr, sizeof(T));
+    if (code_cached_ && code_pages_.load(std::memory_order_relaxed)) {
+      invalidate_code(addr, sizeof(T));
+    }
+  }
+
+  uint8_t load8(uint64_t addr) { return load<uint8_t>(addr); }
+  uint16_t load16(uint64_t addr) { return load<uint16_t>(addr); }
+  uint32_t load32(uint64_t addr) { return load<uint32_t>(addr); }
+  uint64_t load64(uint64_t addr) { return load<uint64_t>(addr); }
+  void store8(uint64_t addr, uint8_t value) { store<uint8_t>(addr, value); }
+  void store16(uint64_t addr, uint16_t value) { store<uint16_t>(addr, value); }
+  void store32(uint64_t addr, uint32_t value) { store<uint32_t>(addr, value); }
+  void store64(uint64_t addr, uint64_t value) { store<uint64_t>(addr, value); }
 
   void debug_mem(uint64_t paddr);
 
+  // Dirty page tracking
+  // Every store into RAM sets the bit of its 4KB page, so snapshots,
+  // writeback and code caches only visit pages that changed.
+  // Writers that bypass store<T> (e.g. device DMA) must call notify_write().
+  void mark_dirty(uint64_t paddr, uint64_t len) {
+    uint64_t first = (paddr - text_start_) >> GUEST_PAGE_SHIFT;
+    uint64_t last = (paddr + len - 1 - text_start_) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = first; (page <= last) && (page < dirty_pages_);
+         page++) {
+      std::atomic<uint64_t> &word = dirty_[page / 64];
+      uint64_t bit = uint64_t(1) << (page % 64);
+      // Skip the atomic RMW when the page is already dirty.
+      if (!(word.load(std::memory_order_relaxed) & bit)) {
+        word.fetch_or(bit, std::memory_order_relaxed);
+      }
+    }
+  }
+  bool is_dirty(uint64_t paddr) const;
+  uint64_t count_dirty() const;
+  // Atomically fetch and clear the bitmap, appending the guest physical
+  // address of every dirty page to pages.
+  void collect_dirty(std::vector<uint64_t> &pages);
+
+  // Code page tracking
+  // A decode or translation cache calls track_code_page() for every page it
+  // caches code from. A write to a tracked page untracks it and calls the
+  // invalidation callbacks with the page's range, on the writing thread.
+  // Until a cache registers its callback, stores skip the tracking entirely.
+  using CodeInvalidateCallback = std::function<void(uint64_t, uint64_t)>;
+  void add_code_invalidate_callback(CodeInvalidateCallback callback);
+  void track_code_page(uint64_t paddr);
+  bool is_code_page(uint64_t paddr) const;
+  void invalidate_code(uint64_t paddr, uint64_t len);
+  void invalidate_all_code();
+
+  // Record a write of [paddr, paddr + len) that bypassed store<T>.
+  void notify_write(uint64_t paddr, uint64_t len) {
+    mark_dirty(paddr, len);
+    if (code_cached_ && code_pages_.load(std::memory_order_relaxed)) {
+      invalidate_code(paddr, len);
+    }
+  }
+
 private:
   void show_stack(uint64_t sp);
 
+  std::vector<std::atomic<uint64_t>> dirty_;
+  uint64_t dirty_pages_ = 0;
+
+  std::vector<std::atomic<uint64_t>> code_;
+  // set once a code cache registers, before any vCPU or I/O thread runs
+  bool code_cached_ = false;
+  // number of tracked code pages, so stores skip the bitmap when it is 0
+  std::atomic<uint64_t> code_pages_ = 0;
+  std::vector<CodeInvalidateCallback> code_invalidate_callbacks_;
+
   uint64_t key;
   bool no_text = false;
 };
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "disk.h"
+
+// Delta file layout
+//   OverlayHeader
+//   index: one uint64_t per cluster, the file offset of its data or 0
+//   cluster data, cluster aligned, appended when a cluster is first written
+const char OVERLAY_MAGIC[8] = {'A', 'E', 'M', 'U', 'C', 'O', 'W', '\0'};
+const uint32_t OVERLAY_VERSION = 1;
+const uint64_t OVERLAY_CLUSTER_SIZE = 64 * 1024;
+
+struct OverlayHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t cluster_size;
+  // size of the base image
+  uint64_t disk_size;
+  uint64_t index_offset;
+  uint64_t num_clusters;
+};
+
+// Copy-on-write overlay on a read-only base image
+// The base image is mmap'ed read-only and shared, so every instance started
+// from the same image shares its page cache. Each instance writes to its own
+// delta file, which only grows by the clusters the guest actually writes.
+//
+// The index entries of new clusters are only written by flush(), after the
+// cluster data is synced, so a crash never leaves an entry pointing at
+// garbage and allocation does not wait for the disk.
+class OverlayDisk : public Disk {
+public:
+  OverlayDisk(const std::string &base, const std::string &overlay);
+  ~OverlayDisk();
+  OverlayDisk(const OverlayDisk &) = delete;
+  OverlayDisk &operator=(const OverlayDisk &) = delete;
+
+  bool read(uint64_t offset, uint8_t *dst, uint64_t len) override;
+  bool write(uint64_t offset, const uint8_t *src, uint64_t len) override;
+  bool flush() override;
+
+private:
+  int base_fd_;
+  const uint8_t *base_;
+  int fd_;
+  OverlayHeader header_;
+  // file offset of each cluster in the delta file, 0 if not written yet
+  std::vector<std::atomic<uint64_t>> index_;
+  // serializes cluster allocation
+  std::mutex alloc_mutex_;
+  uint64_t next_cluster_;
+  // clusters allocated since the last flush, whose index entry is not in the
+  // file yet
+  std::vector<uint64_t> unsynced_;
+  // serializes flush()
+  std::mutex flush_mutex_;
+
+  uint64_t allocate_cluster(uint64_t cluster);
+};
+
+// Write the clusters of an overlay back into its base image.
+// Returns 0 on success, -1 on errors.
+int commit_overlay(const std::string &overlay, const std::string &base);
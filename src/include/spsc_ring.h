@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Lock-free single-producer/single-consumer ring buffer
+// One thread calls push() and another calls pop(). The producer publishes an
+// element with a release store of tail_ and the consumer frees a slot with a
+// release store of head_, so no locks are needed. The capacity is rounded up
+// to a power of two.
+template <typename T> class SpscRing {
+public:
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    buf_ = std::make_unique<T[]>(size);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // producer side
+  bool push(const T &value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    buf_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side
+  bool pop(T &value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = buf_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called concurrently with push()/pop().
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+
+private:
+  std::unique_ptr<T[]> buf_;
+  size_t mask_;
+  // Keep the indices on separate cache lines to avoid false sharing between
+  // the producer and the consumer.
+  alignas(64) std::atomic<size_t> head_ = 0;
+  alignas(64) std::atomic<size_t> tail_ = 0;
+};
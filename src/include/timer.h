@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "clock.h"
+#include "event_queue.h"
+#include "gic.h"
+
+// CNTV_CTL_EL0
+const uint64_t TIMER_CTL_ENABLE = 1 << 0;
+const uint64_t TIMER_CTL_IMASK = 1 << 1;
+const uint64_t TIMER_CTL_ISTATUS = 1 << 2;
+
+// Generic timer of one CPU: the virtual timer, which drives its PPI as a level
+// line while CNTVCT_EL0 >= CNTV_CVAL_EL0. CNTVCT_EL0 is the system counter of
+// the Clock with a zero offset.
+//
+// The timer is checked by an event on the CPU's event queue, due at CVAL.
+// No deadline armed means no check at all.
+class Timer {
+public:
+  void init(Gic *gic, EventQueue *events, uint32_t cpu, const Clock *clock);
+
+  uint64_t counter() const;
+  uint64_t ctl() const;
+  void set_ctl(uint64_t value);
+  uint64_t cval() const { return cval_; }
+  void set_cval(uint64_t value);
+  uint64_t tval() const;
+  void set_tval(uint64_t value);
+
+private:
+  Gic *gic_ = nullptr;
+  EventQueue *events_ = nullptr;
+  uint32_t cpu_ = 0;
+  const Clock *clock_ = nullptr;
+
+  uint64_t ctl_ = 0;
+  uint64_t cval_ = 0;
+  Event check_event_{[this] { update(); }};
+
+  void update();
+};
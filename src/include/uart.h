@@ -1,26 +1,112 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <mutex>
+#include <thread>
 
-const uint8_t UART_RX_BUFF_LEN = 64;
+#include "clock.h"
+#include "event_queue.h"
+#include "gic.h"
+#include "spsc_ring.h"
+
+// Console configuration taken from the command line
+struct UartOptions {
+  // Capacity of the receive ring in bytes. When it is full the input thread
+  // stops reading, so input is held back on the host instead of dropped.
+  size_t rx_buffer_size = 4096;
+  // Write every transmitted character straight to stdout.
+  bool tx_unbuffered = false;
+};
+
+// Transmitted characters are line buffered in stdout. Output without a newline
+// is flushed after at most this long.
+const size_t UART_TX_BUFF_LEN = 4096;
+const std::chrono::milliseconds UART_TX_FLUSH_INTERVAL(20);
+
+// PL011 FIFO depth
+const size_t UART_FIFO_DEPTH = 32;
+// FIFO trigger levels selected by UARTIFLS: 1/8, 1/4, 1/2, 3/4 and 7/8 full
+const size_t UART_IFLS_LEVELS[] = {4, 8, 16, 24, 28};
+const uint16_t UART_IFLS_RESET = 0x12;
+
+// Receive timeout: 32 bit periods after the last character arrived, at
+// 115200 baud since the emulated line has no real rate.
+const uint64_t UART_RX_TIMEOUT = 32 * TIMER_FREQ / 115200;
+
+// UARTFR
+const uint16_t UART_FR_RXFE = 1 << 4;
+const uint16_t UART_FR_TXFF = 1 << 5;
+const uint16_t UART_FR_RXFF = 1 << 6;
+const uint16_t UART_FR_TXFE = 1 << 7;
+// UARTLCR_H
+const uint16_t UART_LCRH_FEN = 1 << 4;
+// UARTRIS, UARTMIS, UARTIMSC and UARTICR
+const uint16_t UART_INT_RX = 1 << 4;
+const uint16_t UART_INT_TX = 1 << 5;
+const uint16_t UART_INT_RT = 1 << 6;
 
 class Uart {
 public:
+  explicit Uart(const UartOptions &options);
+  ~Uart();
+  Uart(const Uart &) = delete;
+  Uart &operator=(const Uart &) = delete;
+
+  void init(Gic *gic, EventQueue *events);
+  // Start the host input thread reading fd. shutdown() stops the host threads
+  // and flushes pending output.
+  void start_input(int fd);
+  void shutdown();
+
   void store(uint64_t addr, uint64_t value);
   uint64_t load(uint64_t addr);
 
-  bool is_interrupting();
-  uint16_t uart_dr;
-  uint8_t uart_rx_idx = 0;
-  uint8_t uart_rx_last_idx = 0;
-  uint8_t uart_rx_buff[UART_RX_BUFF_LEN];
-
 private:
-  uint16_t uart_fr = 0x90;
-  uint16_t uart_lcr_h;
-  uint16_t uart_cr;
-  uint16_t uart_imsc;
-  uint16_t uart_icr = 0x10;
+  uint16_t uart_lcr_h = 0;
+  uint16_t uart_cr = 0;
+  uint16_t uart_imsc = 0;
+  uint16_t uart_ifls = UART_IFLS_RESET;
+  // raw interrupt status (UARTRIS)
+  uint16_t uart_ris = 0;
+  Gic *gic_ = nullptr;
+  EventQueue *events_ = nullptr;
+  // posted by the input thread when it adds data to rx_ring_
+  Event rx_event_{[this] { receive(); }};
+  // scheduled UART_RX_TIMEOUT after data arrives
+  Event rx_timeout_event_{[this] { rx_timeout(); }};
+
+  // Received bytes. The input thread is the only producer and the vCPU
+  // thread the only consumer. The receive FIFO is the head of the ring, so
+  // its level is the ring size capped at the FIFO depth, and bytes behind it
+  // wait on the host as if they were still on the line.
+  SpscRing<uint8_t> rx_ring_;
+  std::thread input_thread_;
+  // eventfd waking the input thread, on shutdown or when the ring drains
+  int wake_fd_;
+  std::atomic<bool> stop_{false};
+  // set by the input thread while it waits for room in the ring
+  std::atomic<bool> input_waiting_{false};
+
+  // Set when stdout holds output without a trailing newline. The flush
+  // thread checks it every UART_TX_FLUSH_INTERVAL.
+  std::atomic<bool> tx_pending_{false};
+  std::thread flush_thread_;
+  std::mutex flush_mutex_;
+  std::condition_variable flush_cv_;
+  bool flush_stop_ = false;
 
-  uint64_t counter = 0;
+  void input_loop(int fd);
+  void flush_loop();
+  void transmit(uint8_t c);
+  bool pop_rx(uint8_t &c);
+  size_t fifo_depth() const;
+  size_t rx_level() const;
+  size_t rx_trigger() const;
+  void receive();
+  void rx_timeout();
+  void update_irq();
 };
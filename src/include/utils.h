@@ -71,4 +71,13 @@ uint64_t set_lower32(uint64_t dst, uint64_t src);
 uint64_t set_lower(uint64_t dst, uint64_t src, MemAccessSize size);
 
 uint64_t shift_with_type(uint64_t value, uint8_t type, uint8_t amount);
+
+// Parse a size such as "512", "64K", "256M" or "2G".
+// A number without a suffix is multiplied by default_unit.
+bool parse_size(const char *str, uint64_t default_unit, uint64_t *size);
+
+// pread/pwrite the whole range, retrying short transfers.
+// Return false on errors and at end of file.
+bool pread_full(int fd, void *buf, uint64_t len, uint64_t offset);
+bool pwrite_full(int fd, const void *buf, uint64_t len, uint64_t offset);
 } // namespace util
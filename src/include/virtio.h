@@ -1,13 +1,20 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <optional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <stdint.h>
 
-class Cpu;
+#include "disk.h"
+#include "event_queue.h"
+#include "gic.h"
+
+class IoWorker;
+class Mem;
 
 const uint64_t VIRTIO_MMIO = 0xa000000;
 const uint64_t VIRTIO_MMIO_MAGIC_VALUE = VIRTIO_MMIO;
@@ -24,16 +31,46 @@ const uint32_t VIRTIO_MMIO_QUEUE_NUM_MAX = VIRTIO_MMIO + 0x34;
 const uint32_t VIRTIO_MMIO_QUEUE_NUM = VIRTIO_MMIO + 0x38;
 const uint32_t VIRTIO_MMIO_QUEUE_ALIGN = VIRTIO_MMIO + 0x3c;
 const uint32_t VIRTIO_MMIO_QUEUE_PFN = VIRTIO_MMIO + 0x40;
+const uint64_t VIRTIO_MMIO_QUEUE_READY = VIRTIO_MMIO + 0x44;
 const uint32_t VIRTIO_MMIO_QUEUE_NOTIFY = VIRTIO_MMIO + 0x50;
 const uint32_t VIRTIO_MMIO_INTERRUPT_STATUS = VIRTIO_MMIO + 0x60;
 const uint32_t VIRTIO_MMIO_INTERRUPT_ACK = VIRTIO_MMIO + 0x64;
 const uint64_t VIRTIO_MMIO_STATUS = VIRTIO_MMIO + 0x70;
+const uint64_t VIRTIO_MMIO_QUEUE_DESC_LOW = VIRTIO_MMIO + 0x80;
+const uint64_t VIRTIO_MMIO_QUEUE_DESC_HIGH = VIRTIO_MMIO + 0x84;
+const uint64_t VIRTIO_MMIO_QUEUE_DRIVER_LOW = VIRTIO_MMIO + 0x90;
+const uint64_t VIRTIO_MMIO_QUEUE_DRIVER_HIGH = VIRTIO_MMIO + 0x94;
+const uint64_t VIRTIO_MMIO_QUEUE_DEVICE_LOW = VIRTIO_MMIO + 0xa0;
+const uint64_t VIRTIO_MMIO_QUEUE_DEVICE_HIGH = VIRTIO_MMIO + 0xa4;
+const uint64_t VIRTIO_MMIO_CONFIG_GENERATION = VIRTIO_MMIO + 0xfc;
 const uint64_t VIRTIO_MMIO_CONFIG = VIRTIO_MMIO + 0x100;
+// The configuration space fills the rest of the register window.
+const uint64_t VIRTIO_MMIO_CONFIG_SIZE = 0x100;
+
+// Device status
+const uint32_t VIRTIO_CONFIG_S_DRIVER_OK = 0x4;
 
 const uint64_t VRING_DESC_F_NEXT = 0x1;
 const uint64_t VRING_DESC_F_WRITE = 0x2;
+const uint64_t VRING_DESC_F_INDIRECT = 0x4;
 const uint64_t VRING_DESC_SIZE = 0x10;
-const uint64_t SECTOR_SIZE = 512;
+
+const uint16_t VRING_AVAIL_F_NO_INTERRUPT = 0x1;
+
+// Feature bits
+const uint32_t VIRTIO_RING_F_INDIRECT_DESC = 28;
+const uint32_t VIRTIO_RING_F_EVENT_IDX = 29;
+const uint32_t VIRTIO_F_VERSION_1 = 32;
+const uint32_t VIRTIO_BLK_F_MQ = 12;
+
+const uint32_t VIRTIO_BLK_T_IN = 0;
+const uint32_t VIRTIO_BLK_T_OUT = 1;
+const uint32_t VIRTIO_BLK_T_FLUSH = 4;
+const uint64_t VIRTIO_BLK_REQ_HEADER_SIZE = 16;
+
+const uint8_t VIRTIO_BLK_S_OK = 0;
+const uint8_t VIRTIO_BLK_S_IOERR = 1;
+const uint8_t VIRTIO_BLK_S_UNSUPP = 2;
 
 // See
 // https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.html#x1-1560004
@@ -41,7 +78,7 @@ struct virtio_mmio_control_registers {
   uint32_t magic_value = 0x74726976;
 
   // Version ID
-  // 1 for legacy device.
+  // 1 for legacy device, 2 for the modern register layout.
   uint32_t version = 1;
 
   // Device ID
@@ -53,17 +90,21 @@ struct virtio_mmio_control_registers {
   // Flags representing features the device supports
   // If HostFearutesSel & 0x1 = 0, returns bits 0 to 31.
   // If HostFearutesSel & 0x1 = 1, returns bits 32 to 63.
-  uint32_t host_features = 0x31006ed4;
+  // Includes VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX, but
+  // not VIRTIO_BLK_F_DISCARD or VIRTIO_BLK_F_WRITE_ZEROES, whose requests and
+  // configuration fields are not implemented.
+  // VIRTIO_F_VERSION_1 is added for version 2.
+  uint64_t host_features = 0x31000ed4;
 
   // Device features word selection
-  uint32_t host_heatures_sel;
+  uint32_t host_features_sel = 0;
 
   // Flags representing features understood and activated by the driver
   // Same as host_features.
-  uint32_t guest_features;
+  uint64_t guest_features = 0;
 
   // Activated gurest features word selection
-  uint32_t guest_features_sel;
+  uint32_t guest_features_sel = 0;
 
   // Guest page size
   // This value is writtewn by the driver during initialization,
@@ -72,9 +113,10 @@ struct virtio_mmio_control_registers {
   uint64_t guest_page_size = 0;
 
   // Virtual queue index
-  // Selects the virtual queue that QueueNumMax, QueueNum, QueueAlign and
-  // QueuePFN registers apply to.
-  uint32_t queue_sel;
+  // Selects the virtual queue that QueueNumMax, QueueNum, QueueAlign,
+  // QueuePFN, QueueReady and QueueDesc/Driver/Device registers apply to.
+  // Those registers are kept in Virtqueue.
+  uint32_t queue_sel = 0;
 
   // Maximum virtual queue size
   // Maximum size of the queue the device is ready to process.
@@ -82,22 +124,6 @@ struct virtio_mmio_control_registers {
   // QueuePFN == 0.
   uint32_t queue_num_max = 0x10;
 
-  // Virtual queue size
-  // The number of elements in the queue.
-  // Writing to this register notifies the device what size the driver will use.
-  uint32_t queue_num = 0;
-
-  // Used Ring alignment in the virtual queue
-  // Writing to this register notifies the device about alignment boundary of
-  // the Used ring. Should be power of 2/
-  uint32_t queue_align;
-
-  // Guest physical page number of the virtual queue
-  // The location of the virtual queue in the Guest's physical address space.
-  // This value is the index number of a page starting with the queue Desctiptor
-  // Table. Zero means that the driver stops using the queue.
-  uint32_t queue_pfn = 0;
-
   // Queue notifier
   // Writin to this register notifies the device that there are new buffers to
   // process in a queue.
@@ -113,8 +139,45 @@ struct virtio_mmio_control_registers {
   // Device status
   // Writing zero means reset.
   uint32_t status = 0;
+
+  // Configuration atomicity value (version 2)
+  // The configuration space never changes, so this stays zero.
+  uint32_t config_generation = 0;
 };
 
+// Device configuration space of a block device, at VIRTIO_MMIO_CONFIG
+struct virtio_blk_config {
+  // size of the disk in 512-byte sectors
+  uint64_t capacity;
+  uint32_t size_max;
+  // maximum number of data segments in a request (VIRTIO_BLK_F_SEG_MAX)
+  uint32_t seg_max;
+  struct {
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+  } geometry;
+  uint32_t blk_size;
+  struct {
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+  } topology;
+  uint8_t writeback;
+  uint8_t unused0;
+  // number of virtqueues (VIRTIO_BLK_F_MQ)
+  uint16_t num_queues;
+};
+static_assert(offsetof(virtio_blk_config, num_queues) == 0x22,
+              "virtio_blk_config layout");
+
+// True if the other side asked to be notified when the ring index moves from
+// old to new_idx, i.e. it passed event (VIRTIO_RING_F_EVENT_IDX).
+inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+  return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
 struct avairable_ring {
   uint16_t flags;
   uint16_t idx;
@@ -123,38 +186,78 @@ struct avairable_ring {
 
 class Desc {
 public:
-  Desc(uint64_t base_addr, Cpu *cpu);
+  Desc(uint64_t base_addr, Mem *mem);
   uint64_t addr;
   uint32_t len;
   uint16_t flags;
   uint16_t next;
 };
 
+// State of one virtual queue
 class Virtqueue {
 public:
-  Virtqueue(uint32_t pfn, uint32_t page_size, uint32_t queue_num);
-  ~Virtqueue() = default;
+  // Forget the queue configuration, e.g. on device reset.
+  void reset() {
+    uint32_t next_epoch = epoch + 1;
+    *this = Virtqueue();
+    epoch = next_epoch;
+  }
+  // Start again from the beginning of the rings.
+  void restart() {
+    last_avail_idx = 0;
+    used_idx = 0;
+    epoch++;
+  }
+
+  // Bumped by reset() and restart(). Requests carry the epoch they were
+  // made available in, and those still on an I/O thread across a reset are
+  // dropped when they complete.
+  uint32_t epoch = 0;
+
+  // Virtual queue size (QueueNum)
+  // The number of elements in the queue.
+  // Writing to this register notifies the device what size the driver will use.
+  uint32_t num = 0;
+
+  // Used Ring alignment in the virtual queue (QueueAlign, legacy)
+  // Writing to this register notifies the device about alignment boundary of
+  // the Used ring. Should be power of 2/
+  // Zero means the guest page size.
+  uint32_t align = 0;
+
+  // Guest physical page number of the virtual queue (QueuePFN, legacy)
+  // The location of the virtual queue in the Guest's physical address space.
+  // This value is the index number of a page starting with the queue Desctiptor
+  // Table. Zero means that the driver stops using the queue.
+  uint32_t pfn = 0;
+
+  // Virtual queue ready bit (QueueReady, version 2)
+  // Writing one tells the device it can use the queue.
+  uint32_t ready = 0;
 
-  void update(uint32_t pfn, uint32_t page_size, uint32_t queue_num);
+  // The device processes the queue: set on DRIVER_OK (legacy) or QueueReady
+  // (version 2).
+  bool active = false;
 
-  // Descriptor Table
+  // Descriptor Table (QueueDesc)
   // size is 16 * queue_num
   // u64 addr
   // u32 len
   // u16 flags
   // u16 next
-  uint64_t desc_table;
+  uint64_t desc_table = 0;
 
-  // Guest -> Host
+  // Guest -> Host (QueueDriver)
   // size is 6 + 2 * queue_num
   // u16 flags
   // u16 idx
   // u16[QUEUE_NUM] rings
-  // u16 	used_event
-  uint64_t avail_ring;
-  uint16_t avail_idx = 0;
+  // u16 used_event
+  uint64_t avail_ring = 0;
+  // next available ring entry the device will consume
+  uint16_t last_avail_idx = 0;
 
-  // Host -> Guest
+  // Host -> Guest (QueueDevice)
   // size is 6 + 8 * queue_num
   // u16 flags
   // u16 idx
@@ -162,23 +265,91 @@ public:
   //    u32 id
   //    u32 len
   // u16 avail_event
-  uint64_t used_ring;
+  uint64_t used_ring = 0;
+  uint16_t used_idx = 0;
+};
+
+// A guest buffer of a descriptor chain
+struct BlkSegment {
+  uint64_t addr;
+  uint32_t len;
+  // VRING_DESC_F_WRITE: the device writes the buffer, otherwise it reads it
+  bool writable;
+};
+
+// A block request decoded from a descriptor chain
+struct BlkRequest {
+  uint16_t queue;
+  // Virtqueue::epoch when the request was made available
+  uint32_t epoch;
+  uint16_t head;
+  uint32_t type;
+  uint64_t sector;
+  // data buffers in transfer order, without the header and the status byte
+  std::vector<BlkSegment> data;
+  // false if the chain is malformed; the request fails with an I/O error
+  bool valid;
+  // guest physical address of the status byte, if the chain has one
+  bool has_status;
+  uint64_t status;
+};
+
+// A finished request to be put into the used ring
+struct BlkCompletion {
+  uint16_t queue;
+  uint32_t epoch;
+  uint16_t head;
+  uint32_t len;
 };
 
 class Virtio {
 public:
-  Virtio(const std::string &diskname);
+  Virtio(const DiskOptions &options);
+  ~Virtio();
 
+  void init(Mem *mem, Gic *gic, EventQueue *events);
+  // Finish the requests in flight, stop the I/O threads and write back the
+  // disk.
+  void shutdown();
   void store(uint64_t addr, uint64_t value);
   uint64_t load(uint64_t addr);
 
-  void disk_access(Cpu *cpu);
-
-  bool is_interrupting();
+  // No request is being served by an I/O thread.
+  bool idle() const { return in_flight_ == 0; }
 
 private:
   struct virtio_mmio_control_registers control_regs;
-  std::vector<uint8_t> disk;
-  std::optional<Virtqueue> virtqueue;
-  uint64_t id = 0;
+  std::unique_ptr<Disk> disk;
+  std::vector<Virtqueue> queues_;
+  Mem *mem_;
+  Gic *gic_ = nullptr;
+  EventQueue *events_ = nullptr;
+  // VIRTIO_RING_F_EVENT_IDX was negotiated
+  bool event_idx_ = false;
+
+  // Host I/O threads. Requests are handled on the vCPU thread if empty.
+  std::vector<std::unique_ptr<IoWorker>> workers_;
+  // Posted by a worker after it pushes a completion, to collect the
+  // finished requests on the vCPU thread
+  Event completion_event_{[this] { reap_completions(); }};
+  // Requests handed to the I/O threads and not reaped yet
+  size_t in_flight_ = 0;
+  // Completions reaped per queue, reused by reap_completions()
+  std::vector<uint16_t> reaped_;
+
+  Virtqueue *selected_queue();
+  void store_queue_reg(uint64_t addr, uint64_t value);
+  uint64_t load_config(uint64_t offset);
+  void reset();
+  void update_irq();
+  void setup_legacy_queue(Virtqueue &q);
+  void process_queue(uint32_t index);
+  bool walk_chain(Virtqueue &q, uint16_t head, std::vector<BlkSegment> &segs);
+  BlkRequest parse_request(Virtqueue &q, uint16_t head);
+  uint32_t execute_request(const BlkRequest &req);
+  void push_used(Virtqueue &q, uint16_t head, uint32_t len);
+  void publish_used(Virtqueue &q, uint16_t count);
+  void reap_completions();
+
+  friend class IoWorker;
 };
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Lets an idle vCPU (WFI/WFE) sleep until a host thread posts an event for
+// it. Host threads post their event first, e.g. set a flag the vCPU polls,
+// then call ring(), which only takes the lock if the vCPU is asleep.
+class Wakeup {
+public:
+  // Sleep until ring() or deadline, unless ready() is already true. ready()
+  // runs on the vCPU after it has announced it is going to sleep, so an event
+  // posted before it is either seen by ready() or rings.
+  template <typename Pred>
+  void wait_until(std::chrono::steady_clock::time_point deadline,
+                  Pred ready) {
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ready()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_until(lock, deadline, [this] { return rung_; });
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    rung_ = false;
+  }
+
+  void ring();
+
+private:
+  std::atomic<bool> sleeping_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool rung_ = false;
+};
@@ -12,8 +12,8 @@
 #include "log.h"
 #include "utils.h"
 
-Loader::Loader(int argc, char **argv, char **envp)
-    : filename_(argv[1]), argc_(argc), argv_(argv), envp_(envp) {}
+Loader::Loader(const char *filename, uint64_t ram_size)
+    : ram_size(ram_size), filename_(filename) {}
 
 Loader::~Loader() {
   close(fd_);
@@ -25,7 +25,7 @@ int Loader::init() {
 
   // open ELF file
   fd_ = open(filename_, O_RDWR);
-  if (!fd_) {
+  if (fd_ < 0) {
     LOG_SYSTEM("Cannot open %s\n", filename_);
     return -1;
   }
@@ -61,16 +61,32 @@ int Loader::load() {
     return -1;
   }
 
-  // allocate RAM for emulator and 0 clear
-  void *ram_base;
-  if ((ram_base = mmap(NULL, RAM_SIZE, PROT_READ | PROT_EXEC | PROT_WRITE,
-                       MAP_SHARED | MAP_ANONYMOUS, 0, 0)) == (void *)-1) {
+  // allocate RAM for emulator
+  // Pages are committed lazily and zero-filled by the kernel on first touch,
+  // so neither startup time nor RSS depends on ram_size. The area is
+  // over-allocated by one huge page and trimmed to a 2MB boundary so that it
+  // can be backed by transparent huge pages.
+  uint64_t area_size = ram_size + HUGE_PAGE_SIZE;
+  void *area;
+  if ((area = mmap(NULL, area_size, PROT_READ | PROT_EXEC | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) ==
+      (void *)-1) {
     perror("mmap");
     return -1;
   }
-  memset(ram_base, 0, RAM_SIZE);
-  map_base = (uint64_t)ram_base;
-  LOG_SYSTEM("\tmap_base(host):0x%lx, RAM_SIZE:0x%x\n", map_base, RAM_SIZE);
+  uint64_t area_start = (uint64_t)area;
+  map_base = (area_start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  if (map_base > area_start) {
+    munmap(area, map_base - area_start);
+  }
+  if (area_start + area_size > map_base + ram_size) {
+    munmap((void *)(map_base + ram_size),
+           area_start + area_size - (map_base + ram_size));
+  }
+  if (madvise((void *)map_base, ram_size, MADV_HUGEPAGE) < 0) {
+    LOG_SYSTEM("\tmadvise(MADV_HUGEPAGE) failed, using small pages\n");
+  }
+  LOG_SYSTEM("\tmap_base(host):0x%lx, ram_size:0x%lx\n", map_base, ram_size);
 
   LOG_SYSTEM("\ttext_start_paddr:0x%lx\n", text_start_paddr);
 
@@ -87,39 +103,76 @@ int Loader::load() {
       use_paddr_ = true;
     }
 
-    // memcpy LOAD segment
-    LOG_SYSTEM("\tmemcpy:\n");
-    LOG_SYSTEM("map_base : 0x%lx\n", map_base);
-    LOG_SYSTEM("\t\tload (emu): 0x%lx-0x%lx, size:0x%lx\n", ph->p_paddr,
-               ph->p_paddr + ph->p_memsz, ph->p_memsz);
-    LOG_SYSTEM("\t\tmemcpy: dst:0x%lx, size:0x%lx\n",
-               map_base + ph->p_paddr - text_start_paddr, ph->p_memsz);
-    LOG_SYSTEM(
-        "\t\tmemcpy: src: file_map_start:%p, ph->p_offset:0x%lx, size:0x%lx\n",
-        file_map_start_, ph->p_offset, ph->p_memsz);
-    memcpy((void *)(map_base + ph->p_paddr - text_start_paddr),
-           (void *)((uint64_t)file_map_start_ + ph->p_offset), ph->p_filesz);
-
-    // zero clear .bss section
-    if (ph->p_memsz > ph->p_filesz) {
-      LOG_SYSTEM("\t\tzeroclear .bss (host):from:0x%lx, size:0x%lx\n",
-                 map_base + ph->p_paddr + ph->p_filesz - text_start_paddr,
-                 ph->p_memsz - ph->p_filesz);
-      LOG_SYSTEM("\t\tzeroclear .bss (emu) :from:0x%lx, size:0x%lx\n",
-                 ph->p_paddr + ph->p_filesz, ph->p_memsz - ph->p_filesz);
-      memset((void *)(map_base + ph->p_paddr + ph->p_filesz - text_start_paddr),
-             0, ph->p_memsz - ph->p_filesz);
+    if ((ph->p_paddr < text_start_paddr) ||
+        (ph->p_paddr + ph->p_memsz > text_start_paddr + ram_size)) {
+      LOG_SYSTEM("segment 0x%lx-0x%lx does not fit in RAM\n", ph->p_paddr,
+                 ph->p_paddr + ph->p_memsz);
+      return -1;
     }
+
+    LOG_SYSTEM("\t\tload (emu): 0x%lx-0x%lx, filesz:0x%lx, memsz:0x%lx\n",
+               ph->p_paddr, ph->p_paddr + ph->p_memsz, ph->p_filesz,
+               ph->p_memsz);
+    if (load_segment(ph) < 0) {
+      return -1;
+    }
+
+    // .bss needs no clearing: RAM is fresh anonymous memory and
+    // load_segment() never maps file pages beyond p_filesz.
     entry = eh_->e_entry - ph->p_vaddr + ph->p_paddr;
   }
 
   // prepare stack
-  init_sp = text_start_paddr + RAM_SIZE;
+  init_sp = text_start_paddr + ram_size;
   init_sp = init_sp - (init_sp % 16) + 16;
   LOG_SYSTEM("\tinit_sp: 0x%lx\n", init_sp);
   return 0;
 }
 
+// Place the file contents of a PT_LOAD segment in guest RAM.
+// Whole pages are mapped from the ELF file with MAP_FIXED|MAP_PRIVATE, so they
+// are read lazily on first guest access and copied only when written. Only
+// the unaligned head and tail fragments are copied. If the file offset and
+// the load address are not congruent modulo the page size, the segment is
+// copied as a whole.
+int Loader::load_segment(const Elf64_Phdr *ph) {
+  uint64_t dst = map_base + ph->p_paddr - text_start_paddr;
+  uint64_t dst_end = dst + ph->p_filesz;
+  const char *src = file_map_start_ + ph->p_offset;
+
+  if ((dst - ph->p_offset) % PAGE_SIZE) {
+    LOG_SYSTEM("\t\tcopy: dst:0x%lx, size:0x%lx (unaligned)\n", dst,
+               ph->p_filesz);
+    memcpy((void *)dst, src, ph->p_filesz);
+    return 0;
+  }
+
+  uint64_t map_start = std::min(util::PAGE_ROUNDUP(dst), dst_end);
+  uint64_t map_end = std::max(dst_end & ~(PAGE_SIZE - 1), map_start);
+
+  // head fragment
+  memcpy((void *)dst, src, map_start - dst);
+
+  // whole pages
+  if (map_end > map_start) {
+    uint64_t offset = ph->p_offset + (map_start - dst);
+    LOG_SYSTEM("\t\tmap: dst:0x%lx, size:0x%lx, file offset:0x%lx\n",
+               map_start, map_end - map_start, offset);
+    if (mmap((void *)map_start, map_end - map_start,
+             PROT_READ | PROT_EXEC | PROT_WRITE, MAP_FIXED | MAP_PRIVATE, fd_,
+             offset) == (void *)-1) {
+      perror("mmap");
+      return -1;
+    }
+  }
+
+  // tail fragment
+  memcpy((void *)map_end, src + (map_end - dst), dst_end - map_end);
+  LOG_SYSTEM("\t\tcopy: head:0x%lx, tail:0x%lx\n", map_start - dst,
+             dst_end - map_end);
+  return 0;
+}
+
 const char *Loader::get_interp() const {
   for (int i = 0; i < eh_->e_phnum; i++) {
     if (ph_tbl_[i].p_type == PT_INTERP) {
@@ -0,0 +1,5 @@
+#include "log.h"
+
+int log_system_on = 0;
+int log_cpu_on = 0;
+int log_debug_on = 0;
@@ -12,10 +12,16 @@
 #include "log.h"
 #include "utils.h"
 
-void Mem::init(uint64_t text_start, uint64_t text_size, uint64_t map_base) {
+void Mem::init(uint64_t text_start, uint64_t text_size, uint64_t map_base,
+               uint64_t ram_size) {
   text_start_ = text_start;
   text_size_ = text_size;
   map_base_ = map_base;
+  ram_size_ = ram_size;
+
+  dirty_pages_ = (ram_size + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT;
+  dirty_ = std::vector<std::atomic<uint64_t>>((dirty_pages_ + 63) / 64);
+  code_ = std::vector<std::atomic<uint64_t>>((dirty_pages_ + 63) / 64);
 }
 
 void Mem::clean_mem() {
@@ -37,93 +43,97 @@ void Mem::show_stack(uint64_t sp) {
   }
 }
 
-uint64_t Mem::get_ptr(uint64_t paddr) {
-  return paddr - text_start_ + map_base_;
-}
-
-void Mem::store8(uint64_t addr, const uint8_t value) {
-  uint8_t *p = (uint8_t *)get_ptr(addr);
-  p[0] = (uint8_t)value;
+void Mem::debug_mem(uint64_t paddr) {
+  LOG_SYSTEM("0x%lx: %lx %lx %lx %lx\n", paddr, load64(paddr),
+             load64(paddr + 8), load64(paddr + 16), load64(paddr + 24));
 }
 
-void Mem::store16(uint64_t addr, const uint16_t value) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return;
+bool Mem::is_dirty(uint64_t paddr) const {
+  uint64_t page = (paddr - text_start_) >> GUEST_PAGE_SHIFT;
+  if (page >= dirty_pages_) {
+    return false;
   }
-  p[0] = value;
-  p[1] = (uint8_t)(value >> 8);
+  return (dirty_[page / 64].load(std::memory_order_relaxed) >> (page % 64)) &
+         1;
 }
 
-void Mem::store32(uint64_t addr, const uint32_t value) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return;
+uint64_t Mem::count_dirty() const {
+  uint64_t count = 0;
+  for (const std::atomic<uint64_t> &word : dirty_) {
+    count += __builtin_popcountll(word.load(std::memory_order_relaxed));
   }
-  p[0] = value;
-  p[1] = (uint8_t)(value >> 8);
-  p[2] = (uint8_t)(value >> 16);
-  p[3] = (uint8_t)(value >> 24);
+  return count;
 }
 
-void Mem::store64(uint64_t addr, const uint64_t value) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return;
+void Mem::collect_dirty(std::vector<uint64_t> &pages) {
+  for (uint64_t i = 0; i < dirty_.size(); i++) {
+    if (!dirty_[i].load(std::memory_order_relaxed)) {
+      continue;
+    }
+    uint64_t bits = dirty_[i].exchange(0, std::memory_order_acq_rel);
+    while (bits) {
+      uint64_t page = i * 64 + __builtin_ctzll(bits);
+      pages.push_back(text_start_ + (page << GUEST_PAGE_SHIFT));
+      bits &= bits - 1;
+    }
   }
-  p[0] = value;
-  p[1] = (uint8_t)(value >> 8);
-  p[2] = (uint8_t)(value >> 16);
-  p[3] = (uint8_t)(value >> 24);
-  p[4] = (uint8_t)(value >> 32);
-  p[5] = (uint8_t)(value >> 40);
-  p[6] = (uint8_t)(value >> 48);
-  p[7] = (uint8_t)(value >> 56);
 }
 
-uint8_t Mem::load8(uint64_t addr) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return 0;
-  }
-  return *(uint8_t *)p;
+void Mem::add_code_invalidate_callback(CodeInvalidateCallback callback) {
+  code_invalidate_callbacks_.push_back(callback);
+  code_cached_ = true;
 }
 
-uint16_t Mem::load16(uint64_t addr) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return 0;
+// Pages tracked without a registered cache would never be invalidated, so
+// they are not tracked.
+void Mem::track_code_page(uint64_t paddr) {
+  uint64_t page = (paddr - text_start_) >> GUEST_PAGE_SHIFT;
+  if (!code_cached_ || (page >= dirty_pages_)) {
+    return;
+  }
+  uint64_t bit = uint64_t(1) << (page % 64);
+  if (!(code_[page / 64].fetch_or(bit, std::memory_order_acq_rel) & bit)) {
+    code_pages_.fetch_add(1, std::memory_order_relaxed);
   }
-  return p[0] | p[1] << 8;
 }
 
-uint32_t Mem::load32(uint64_t addr) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return 0;
+bool Mem::is_code_page(uint64_t paddr) const {
+  uint64_t page = (paddr - text_start_) >> GUEST_PAGE_SHIFT;
+  if (page >= dirty_pages_) {
+    return false;
   }
-  return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24 | uint64_t(p[4]) << 32;
+  return (code_[page / 64].load(std::memory_order_relaxed) >> (page % 64)) & 1;
 }
 
-uint64_t Mem::load64(uint64_t addr) {
-  uint8_t *p;
-  if (!(p = (uint8_t *)get_ptr(addr))) {
-    LOG_SYSTEM("cannot access to 0x%lx\n", addr);
-    return 0;
+void Mem::invalidate_code(uint64_t paddr, uint64_t len) {
+  uint64_t first = (paddr - text_start_) >> GUEST_PAGE_SHIFT;
+  uint64_t last = (paddr + len - 1 - text_start_) >> GUEST_PAGE_SHIFT;
+  for (uint64_t page = first; (page <= last) && (page < dirty_pages_);
+       page++) {
+    std::atomic<uint64_t> &word = code_[page / 64];
+    uint64_t bit = uint64_t(1) << (page % 64);
+    if (!(word.load(std::memory_order_relaxed) & bit)) {
+      continue;
+    }
+    // Only the thread that clears the bit fires the callbacks.
+    if (!(word.fetch_and(~bit, std::memory_order_acq_rel) & bit)) {
+      continue;
+    }
+    code_pages_.fetch_sub(1, std::memory_order_relaxed);
+    uint64_t page_addr = text_start_ + (page << GUEST_PAGE_SHIFT);
+    LOG_DEBUG("mem: invalidate code page 0x%lx\n", page_addr);
+    for (CodeInvalidateCallback &callback : code_invalidate_callbacks_) {
+      callback(page_addr, GUEST_PAGE_SIZE);
+    }
   }
-
-  return uint64_t(p[0]) | uint64_t(p[1]) << 8 | uint64_t(p[2]) << 16 |
-         uint64_t(p[3]) << 24 | uint64_t(p[4]) << 32 | uint64_t(p[5]) << 40 |
-         uint64_t(p[6]) << 48 | uint64_t(p[7]) << 56;
 }
 
-void Mem::debug_mem(uint64_t paddr) {
-  LOG_SYSTEM("0x%lx: %lx %lx %lx %lx\n", paddr, load64(paddr),
-             load64(paddr + 8), load64(paddr + 16), load64(paddr + 24));
+void Mem::invalidate_all_code() {
+  for (std::atomic<uint64_t> &word : code_) {
+    word.store(0, std::memory_order_relaxed);
+  }
+  code_pages_.store(0, std::memory_order_release);
+  for (CodeInvalidateCallback &callback : code_invalidate_callbacks_) {
+    callback(text_start_, ram_size_);
+  }
 }
\ No newline at end of file
@@ -58,7 +58,7 @@ uint64_t MMU::l0_translate(uint64_t addr, uint64_t base) {
 
   LOG_DEBUG("L0\n");
   index = util::shift(addr, g4kb_l0_start_bit, g4kb_l0_start_bit + 8);
-  entry = bus_->load((uint64_t)(base + index * 8), MemAccessSize::DWord);
+  entry = bus_->load<uint64_t>(base + index * 8);
 
   LOG_DEBUG("\tbase  = 0x%lx\n", base);
   LOG_DEBUG("\tindex = 0x%ld\n", index);
@@ -79,7 +79,7 @@ uint64_t MMU::l1_translate(uint64_t addr, uint64_t base) {
   uint64_t index, entry, next, output, offset;
   LOG_DEBUG("L1\n");
   index = util::shift(addr, g4kb_l1_start_bit, g4kb_l1_start_bit + 8);
-  entry = bus_->load((uint64_t)(base + index * 8), MemAccessSize::DWord);
+  entry = bus_->load<uint64_t>(base + index * 8);
 
   LOG_DEBUG("\tbase  = 0x%lx\n", base);
   LOG_DEBUG("\tindex = 0x%ld\n", index);
@@ -108,7 +108,7 @@ uint64_t MMU::l2_translate(uint64_t addr, uint64_t base) {
   uint64_t index, entry, next, output, offset;
   LOG_DEBUG("L2\n");
   index = util::shift(addr, g4kb_l2_start_bit, g4kb_l2_start_bit + 8);
-  entry = bus_->load((uint64_t)(base + index * 8), MemAccessSize::DWord);
+  entry = bus_->load<uint64_t>(base + index * 8);
 
   LOG_DEBUG("\tbase  = 0x%lx\n", base);
   LOG_DEBUG("\tindex = 0x%ld\n", index);
@@ -137,7 +137,7 @@ uint64_t MMU::l3_translate(uint64_t addr, uint64_t base) {
   uint64_t index, entry, output, offset;
   LOG_DEBUG("L3\n");
   index = util::shift(addr, g4kb_l3_start_bit, g4kb_l3_start_bit + 8);
-  entry = bus_->load((uint64_t)(base + index * 8), MemAccessSize::DWord);
+  entry = bus_->load<uint64_t>(base + index * 8);
 
   LOG_DEBUG("\tbase  = 0x%lx\n", base);
   LOG_DEBUG("\tindex = 0x%ld\n", index);
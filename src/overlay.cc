@@ -0,0 +1,283 @@
+#include "overlay.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "log.h"
+#include "utils.h"
+
+static uint64_t round_up(uint64_t value, uint64_t align) {
+  return (value + align - 1) / align * align;
+}
+
+// Read and check the header and index of an overlay of file_size bytes for a
+// base of disk_size bytes. Returns false with a message on errors.
+static bool load_overlay(int fd, const std::string &filename,
+                         uint64_t file_size, uint64_t disk_size,
+                         OverlayHeader &header, std::vector<uint64_t> &index) {
+  if (!util::pread_full(fd, &header, sizeof(header), 0) ||
+      memcmp(header.magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC)) ||
+      (header.version != OVERLAY_VERSION) || (header.cluster_size == 0) ||
+      (header.cluster_size & (header.cluster_size - 1))) {
+    std::cerr << filename << " is not an overlay file" << std::endl;
+    return false;
+  }
+  if ((header.disk_size != disk_size) ||
+      (header.num_clusters !=
+       round_up(disk_size, header.cluster_size) / header.cluster_size)) {
+    std::cerr << filename << " was created for a base image of "
+              << header.disk_size << " bytes, not " << disk_size << std::endl;
+    return false;
+  }
+  index.resize(header.num_clusters);
+  if (!util::pread_full(fd, index.data(), index.size() * sizeof(uint64_t),
+                        header.index_offset)) {
+    std::cerr << "Cannot read the index of " << filename << std::endl;
+    return false;
+  }
+  // Every cluster must lie in the data area, after the index, and within the
+  // file.
+  uint64_t data_start =
+      round_up(header.index_offset + header.num_clusters * sizeof(uint64_t),
+               header.cluster_size);
+  for (uint64_t i = 0; i < index.size(); i++) {
+    uint64_t offset = index[i];
+    uint64_t len = std::min<uint64_t>(header.cluster_size,
+                                      disk_size - i * header.cluster_size);
+    if (offset && ((offset % header.cluster_size) || (offset < data_start) ||
+                   (offset > file_size) || (len > file_size - offset))) {
+      std::cerr << filename << ": bad index entry 0x" << std::hex << offset
+                << " for cluster " << std::dec << i << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+OverlayDisk::OverlayDisk(const std::string &base, const std::string &overlay) {
+  struct stat sb;
+
+  base_fd_ = open(base.c_str(), O_RDONLY);
+  if (base_fd_ < 0) {
+    std::cerr << "Cannot open file " << base << std::endl;
+    exit(0);
+  }
+  if ((fstat(base_fd_, &sb) < 0) || (sb.st_size == 0)) {
+    std::cerr << "Cannot use empty disk image " << base << std::endl;
+    exit(0);
+  }
+  size_ = sb.st_size;
+  base_ =
+      (const uint8_t *)mmap(NULL, size_, PROT_READ, MAP_SHARED, base_fd_, 0);
+  if (base_ == (const uint8_t *)-1) {
+    perror("mmap");
+    exit(1);
+  }
+
+  fd_ = open(overlay.c_str(), O_RDWR | O_CREAT, 0644);
+  if ((fd_ < 0) || (fstat(fd_, &sb) < 0)) {
+    std::cerr << "Cannot open file " << overlay << std::endl;
+    exit(0);
+  }
+
+  std::vector<uint64_t> index;
+  if (sb.st_size == 0) {
+    // New overlay: header and an empty (sparse) index.
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC));
+    header_.version = OVERLAY_VERSION;
+    header_.cluster_size = OVERLAY_CLUSTER_SIZE;
+    header_.disk_size = size_;
+    header_.index_offset = sizeof(header_);
+    header_.num_clusters =
+        round_up(size_, OVERLAY_CLUSTER_SIZE) / OVERLAY_CLUSTER_SIZE;
+    index.resize(header_.num_clusters);
+    if (!util::pwrite_full(fd_, &header_, sizeof(header_), 0) ||
+        (ftruncate(fd_, header_.index_offset +
+                            header_.num_clusters * sizeof(uint64_t)) < 0)) {
+      perror("overlay");
+      exit(1);
+    }
+  } else if (!load_overlay(fd_, overlay, sb.st_size, size_, header_,
+                           index)) {
+    exit(0);
+  }
+
+  index_ = std::vector<std::atomic<uint64_t>>(header_.num_clusters);
+  uint64_t written = 0;
+  for (uint64_t i = 0; i < header_.num_clusters; i++) {
+    index_[i].store(index[i], std::memory_order_relaxed);
+    written += (index[i] != 0);
+  }
+  next_cluster_ = std::max<uint64_t>(
+      round_up(header_.index_offset + header_.num_clusters * sizeof(uint64_t),
+               header_.cluster_size),
+      round_up(sb.st_size, header_.cluster_size));
+
+  LOG_SYSTEM("disk: %s, size: 0x%lx, overlay: %s, %ld clusters written\n",
+             base.c_str(), size_, overlay.c_str(), written);
+}
+
+OverlayDisk::~OverlayDisk() {
+  flush();
+  munmap((void *)base_, size_);
+  close(base_fd_);
+  close(fd_);
+}
+
+// Give cluster a place in the delta file, initialized from the base image, and
+// return its file offset.
+uint64_t OverlayDisk::allocate_cluster(uint64_t cluster) {
+  std::lock_guard<std::mutex> lock(alloc_mutex_);
+  uint64_t offset = index_[cluster].load(std::memory_order_acquire);
+  if (offset) {
+    // another I/O thread allocated it meanwhile
+    return offset;
+  }
+  offset = next_cluster_;
+  uint64_t start = cluster * header_.cluster_size;
+  uint64_t len = std::min<uint64_t>(header_.cluster_size, size_ - start);
+  if (!util::pwrite_full(fd_, base_ + start, len, offset)) {
+    perror("overlay");
+    return 0;
+  }
+  next_cluster_ += header_.cluster_size;
+  index_[cluster].store(offset, std::memory_order_release);
+  unsynced_.push_back(cluster);
+  return offset;
+}
+
+bool OverlayDisk::read(uint64_t offset, uint8_t *dst, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  while (len) {
+    uint64_t cluster = offset / header_.cluster_size;
+    uint64_t in_cluster = offset % header_.cluster_size;
+    uint64_t n = std::min<uint64_t>(len, header_.cluster_size - in_cluster);
+    uint64_t file_offset = index_[cluster].load(std::memory_order_acquire);
+    if (file_offset) {
+      if (!util::pread_full(fd_, dst, n, file_offset + in_cluster)) {
+        return false;
+      }
+    } else {
+      memcpy(dst, base_ + offset, n);
+    }
+    offset += n;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool OverlayDisk::write(uint64_t offset, const uint8_t *src, uint64_t len) {
+  if ((offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+  while (len) {
+    uint64_t cluster = offset / header_.cluster_size;
+    uint64_t in_cluster = offset % header_.cluster_size;
+    uint64_t n = std::min<uint64_t>(len, header_.cluster_size - in_cluster);
+    uint64_t file_offset = index_[cluster].load(std::memory_order_acquire);
+    if (!file_offset) {
+      file_offset = allocate_cluster(cluster);
+    }
+    if (!file_offset ||
+        !util::pwrite_full(fd_, src, n, file_offset + in_cluster)) {
+      return false;
+    }
+    offset += n;
+    src += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Sync the data, then write and sync the index entries of the clusters
+// allocated since the last flush. Entries that fail are tried again by the
+// next flush.
+bool OverlayDisk::flush() {
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  std::vector<uint64_t> clusters;
+  {
+    std::lock_guard<std::mutex> lock(alloc_mutex_);
+    clusters.swap(unsynced_);
+  }
+  bool ok = (fdatasync(fd_) == 0);
+  for (uint64_t i = 0; ok && (i < clusters.size()); i++) {
+    uint64_t offset = index_[clusters[i]].load(std::memory_order_relaxed);
+    ok = util::pwrite_full(fd_, &offset, sizeof(offset),
+                           header_.index_offset +
+                               clusters[i] * sizeof(uint64_t));
+  }
+  if (ok && !clusters.empty()) {
+    ok = (fdatasync(fd_) == 0);
+  }
+  if (!ok) {
+    perror("overlay flush");
+    std::lock_guard<std::mutex> lock(alloc_mutex_);
+    unsynced_.insert(unsynced_.end(), clusters.begin(), clusters.end());
+    return false;
+  }
+  return true;
+}
+
+int commit_overlay(const std::string &overlay, const std::string &base) {
+  struct stat sb, ob;
+  int base_fd = open(base.c_str(), O_RDWR);
+  if ((base_fd < 0) || (fstat(base_fd, &sb) < 0)) {
+    std::cerr << "Cannot open file " << base << std::endl;
+    return -1;
+  }
+  int fd = open(overlay.c_str(), O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &ob) < 0)) {
+    std::cerr << "Cannot open file " << overlay << std::endl;
+    if (fd >= 0) {
+      close(fd);
+    }
+    close(base_fd);
+    return -1;
+  }
+
+  int ret = -1;
+  OverlayHeader header;
+  std::vector<uint64_t> index;
+  std::vector<uint8_t> buf;
+  uint64_t committed = 0;
+  if (!load_overlay(fd, overlay, ob.st_size, sb.st_size, header, index)) {
+    goto out;
+  }
+  buf.resize(header.cluster_size);
+  for (uint64_t i = 0; i < header.num_clusters; i++) {
+    if (!index[i]) {
+      continue;
+    }
+    uint64_t start = i * header.cluster_size;
+    uint64_t len = std::min<uint64_t>(header.cluster_size, sb.st_size - start);
+    if (!util::pread_full(fd, buf.data(), len, index[i]) ||
+        !util::pwrite_full(base_fd, buf.data(), len, start)) {
+      perror("commit");
+      goto out;
+    }
+    committed++;
+  }
+  if (fsync(base_fd) < 0) {
+    perror("fsync");
+    goto out;
+  }
+  printf("committed %ld clusters of %s to %s\n", committed, overlay.c_str(),
+         base.c_str());
+  ret = 0;
+out:
+  close(fd);
+  close(base_fd);
+  return ret;
+}
@@ -0,0 +1,53 @@
+#include "timer.h"
+
+#include "log.h"
+
+void Timer::init(Gic *gic, EventQueue *events, uint32_t cpu,
+                 const Clock *clock) {
+  gic_ = gic;
+  events_ = events;
+  cpu_ = cpu;
+  clock_ = clock;
+}
+
+uint64_t Timer::counter() const { return clock_->now(); }
+
+uint64_t Timer::ctl() const {
+  if ((ctl_ & TIMER_CTL_ENABLE) && (counter() >= cval_)) {
+    return ctl_ | TIMER_CTL_ISTATUS;
+  }
+  return ctl_;
+}
+
+void Timer::set_ctl(uint64_t value) {
+  ctl_ = value & (TIMER_CTL_ENABLE | TIMER_CTL_IMASK);
+  update();
+}
+
+void Timer::set_cval(uint64_t value) {
+  cval_ = value;
+  update();
+}
+
+// TVAL is the signed 32-bit distance from the counter to CVAL.
+uint64_t Timer::tval() const { return (uint32_t)(cval_ - counter()); }
+
+void Timer::set_tval(uint64_t value) {
+  cval_ = counter() + (int64_t)(int32_t)value;
+  update();
+}
+
+// Drive the timer PPI and schedule the next check at CVAL. Once met the
+// condition only changes when the guest writes CTL or CVAL, so there is
+// nothing left to check.
+void Timer::update() {
+  uint64_t now = counter();
+  bool met = (ctl_ & TIMER_CTL_ENABLE) && (now >= cval_);
+  gic_->set_level(GIC_PPI_VTIMER, met && !(ctl_ & TIMER_CTL_IMASK), cpu_);
+
+  events_->cancel(check_event_);
+  if ((ctl_ & TIMER_CTL_ENABLE) && !met) {
+    events_->schedule(check_event_, cval_);
+  }
+  LOG_CPU("timer: ctl=0x%lx cval=0x%lx now=0x%lx\n", ctl_, cval_, now);
+}
@@ -1,8 +1,13 @@
 #include "uart.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
 #include <cmath>
@@ -12,39 +17,186 @@
 #include "log.h"
 #include "utils.h"
 
-bool Uart::is_interrupting() {
-  counter++;
-  uint8_t rx_intr_mask = 0b10000;
-  if (counter > 1000) {
-    counter = 0;
-    if (!(uart_imsc & rx_intr_mask)) {
-      return false;
+Uart::Uart(const UartOptions &options) : rx_ring_(options.rx_buffer_size) {
+  wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    perror("eventfd");
+    exit(1);
+  }
+  // stdout is set up by main(), before anything is written to it.
+  if (!options.tx_unbuffered) {
+    flush_thread_ = std::thread(&Uart::flush_loop, this);
+  }
+}
+
+Uart::~Uart() {
+  shutdown();
+  close(wake_fd_);
+}
+
+void Uart::init(Gic *gic, EventQueue *events) {
+  assert(gic && events);
+  gic_ = gic;
+  events_ = events;
+  events_->add_async(rx_event_);
+}
+
+void Uart::start_input(int fd) {
+  input_thread_ = std::thread(&Uart::input_loop, this, fd);
+}
+
+void Uart::shutdown() {
+  if (input_thread_.joinable()) {
+    uint64_t one = 1;
+    stop_.store(true, std::memory_order_release);
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+      perror("eventfd");
+    }
+    input_thread_.join();
+  }
+  if (flush_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(flush_mutex_);
+      flush_stop_ = true;
+    }
+    flush_cv_.notify_one();
+    flush_thread_.join();
+  }
+  fflush(stdout);
+}
+
+// Flush thread: push out partial lines, e.g. shell prompts, that line
+// buffering would otherwise hold back.
+void Uart::flush_loop() {
+  std::unique_lock<std::mutex> lock(flush_mutex_);
+  while (!flush_cv_.wait_for(lock, UART_TX_FLUSH_INTERVAL,
+                             [this] { return flush_stop_; })) {
+    if (tx_pending_.exchange(false)) {
+      fflush(stdout);
+    }
+  }
+}
+
+void Uart::transmit(uint8_t c) {
+  putc(c, stdout);
+  if ((c != '\n') && !tx_pending_.load(std::memory_order_relaxed)) {
+    tx_pending_.store(true, std::memory_order_relaxed);
+  }
+}
+
+// Input thread: move bytes from fd into rx_ring_ until EOF or shutdown().
+// Only as many bytes as fit in the ring are read, so nothing is dropped; while
+// it is full, fd is left alone and the thread sleeps until pop_rx() wakes it.
+void Uart::input_loop(int fd) {
+  uint8_t buf[256];
+  while (!stop_.load(std::memory_order_acquire)) {
+    size_t room = rx_ring_.capacity() - rx_ring_.size();
+    if (room == 0) {
+      input_waiting_.store(true);
+      // Check again, the vCPU may have drained the ring before it could see
+      // input_waiting_.
+      room = rx_ring_.capacity() - rx_ring_.size();
+    }
+    struct pollfd fds[2] = {{wake_fd_, POLLIN, 0}, {fd, POLLIN, 0}};
+    int ret = ::poll(fds, room ? 2 : 1, -1);
+    input_waiting_.store(false);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      uint64_t count;
+      if (read(wake_fd_, &count, sizeof(count)) < 0) {
+        perror("eventfd");
+      }
     }
-    if (!(uart_icr & rx_intr_mask)) {
-      return false;
+    if (room && fds[1].revents) {
+      ssize_t n = read(fd, buf, std::min(room, sizeof(buf)));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // EOF or error
+        break;
+      }
+      for (ssize_t i = 0; i < n; i++) {
+        rx_ring_.push(buf[i]);
+      }
+      events_->post(rx_event_);
     }
-    if (uart_rx_idx != uart_rx_last_idx) {
-      uart_dr = uart_rx_buff[uart_rx_last_idx++];
-      // uart_imsc &= ~rx_intr_mask;
-      uart_icr &= ~rx_intr_mask;
-      uart_fr &= 0xef;
-      return true;
+  }
+}
+
+bool Uart::pop_rx(uint8_t &c) {
+  if (!rx_ring_.pop(c)) {
+    return false;
+  }
+  if (input_waiting_.load() && input_waiting_.exchange(false)) {
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+      perror("eventfd");
     }
   }
-  return false;
+  return true;
+}
+
+// With the FIFOs disabled, they act as one-byte holding registers.
+size_t Uart::fifo_depth() const {
+  return (uart_lcr_h & UART_LCRH_FEN) ? UART_FIFO_DEPTH : 1;
+}
+
+size_t Uart::rx_level() const {
+  return std::min(rx_ring_.size(), fifo_depth());
+}
+
+// Receive FIFO level at which RXIS is raised. Below it, data is reported by
+// the receive timeout. Drivers written against QEMU, which raises RXIS for
+// every character, only unmask RXIM; for them the trigger level stays at one
+// character, as it is with the FIFO disabled.
+size_t Uart::rx_trigger() const {
+  if (!(uart_lcr_h & UART_LCRH_FEN) || !(uart_imsc & UART_INT_RT)) {
+    return 1;
+  }
+  size_t sel = (uart_ifls >> 3) & 0x7;
+  return UART_IFLS_LEVELS[std::min<size_t>(sel, 4)];
+}
+
+// Raise the receive interrupt for data the input thread added, and restart
+// the receive timeout.
+void Uart::receive() {
+  size_t level = rx_level();
+  if (level >= rx_trigger()) {
+    uart_ris |= UART_INT_RX;
+  }
+  if (level) {
+    events_->schedule(rx_timeout_event_, events_->now() + UART_RX_TIMEOUT);
+  }
+  update_irq();
+}
+
+void Uart::rx_timeout() {
+  if (rx_level()) {
+    uart_ris |= UART_INT_RT;
+    update_irq();
+  }
 }
 
+// UARTINTR is level-sensitive: asserted while any unmasked interrupt is raw
+// pending.
+void Uart::update_irq() { gic_->set_level(GIC_SPI_UART, uart_ris & uart_imsc); }
+
 void Uart::store(uint64_t addr, uint64_t value) {
   uint64_t offset = addr & 0xfff;
   switch (offset) {
   case 0x000:
-    uart_dr = value;
-    putc((uint8_t)value, stdout);
-    fflush(stdout);
-    break;
-  case 0x018:
-    uart_fr = value;
-    LOG_CPU("uart_fr = 0x%lx\n", value);
+    transmit(value);
+    // The byte has already left the transmit FIFO, so its level is back
+    // below the trigger and a driver can refill it on TXIS.
+    uart_ris |= UART_INT_TX;
+    update_irq();
     break;
   case 0x02c:
     uart_lcr_h = value;
@@ -54,13 +206,23 @@ void Uart::store(uint64_t addr, uint64_t value) {
     uart_cr = value;
     LOG_CPU("uart_cr = 0x%lx\n", value);
     break;
+  case 0x034:
+    uart_ifls = value & 0x3f;
+    LOG_CPU("uart_ifls = 0x%lx\n", value);
+    break;
   case 0x038:
     uart_imsc = value;
     LOG_CPU("uart_imsc = 0x%lx\n", value);
+    update_irq();
     break;
-  case 0x44:
-    uart_icr = value;
+  case 0x044:
     LOG_CPU("uart_icr = 0x%lx\n", value);
+    uart_ris &= ~value;
+    update_irq();
+    if (rx_level()) {
+      // Data left in the FIFO raises RXIS or times out again.
+      receive();
+    }
     break;
   default:
     LOG_SYSTEM("uart unsupported store 0x%lx\n", offset);
@@ -69,29 +231,52 @@ void Uart::store(uint64_t addr, uint64_t value) {
 
 uint64_t Uart::load(uint64_t addr) {
   uint64_t offset = addr & 0xfff;
-  uint64_t value;
   switch (offset) {
-  case 0x000:
-    LOG_CPU("uart_dr load 0x%x\n", uart_dr);
-    value = uart_dr;
-    uart_dr = 0;
-    uart_fr |= (1 << 4);
-    return value;
-  case 0x018:
-    LOG_CPU("uart_fr load 0x%x\n", uart_fr);
-    return uart_fr;
+  case 0x000: {
+    uint8_t c = 0;
+    pop_rx(c);
+    size_t level = rx_level();
+    if (level < rx_trigger()) {
+      uart_ris &= ~UART_INT_RX;
+    }
+    if (!level) {
+      uart_ris &= ~UART_INT_RT;
+    }
+    update_irq();
+    LOG_CPU("uart_dr load 0x%x\n", c);
+    return c;
+  }
+  case 0x018: {
+    // The transmit FIFO drains into the stdout buffer as soon as it is
+    // written, so it is never full.
+    size_t level = rx_level();
+    uint16_t fr = UART_FR_TXFE;
+    if (!level) {
+      fr |= UART_FR_RXFE;
+    } else if (level == fifo_depth()) {
+      fr |= UART_FR_RXFF;
+    }
+    LOG_CPU("uart_fr load 0x%x\n", fr);
+    return fr;
+  }
   case 0x02c:
     LOG_CPU("uart lcr_h load 0x%x\n", uart_lcr_h);
     return uart_lcr_h;
   case 0x030:
     LOG_CPU("uart_cr load 0x%x\n", uart_cr);
     return uart_cr;
+  case 0x034:
+    LOG_CPU("uart_ifls load 0x%x\n", uart_ifls);
+    return uart_ifls;
   case 0x038:
     LOG_CPU("uart_imsc load 0x%x\n", uart_imsc);
     return uart_imsc;
-  case 0x044:
-    LOG_CPU("uart_icr load 0x%x\n", uart_icr);
-    return uart_icr;
+  case 0x03c:
+    LOG_CPU("uart_ris load 0x%x\n", uart_ris);
+    return uart_ris;
+  case 0x040:
+    LOG_CPU("uart_mis load 0x%x\n", uart_ris & uart_imsc);
+    return uart_ris & uart_imsc;
   default:
     LOG_SYSTEM("uart unsupported load 0x%lx\n", offset);
     return 1;
@@ -1,7 +1,10 @@
 #include "utils.h"
 
+#include <cerrno>
 #include <cstdint>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "log.h"
 #include "mem.h"
@@ -45,4 +48,74 @@ uint64_t set_lower(uint64_t dst, uint64_t src, MemAccessSize size) {
 uint64_t set_lower32(uint64_t dst, uint64_t src) {
   return (dst & ~mask(32)) | (src & mask(32));
 }
+
+bool parse_size(const char *str, uint64_t default_unit, uint64_t *size) {
+  char *end;
+  uint64_t value, unit;
+
+  // strtoull() accepts a sign and negates the value.
+  if (strchr(str, '-')) {
+    return false;
+  }
+  errno = 0;
+  value = strtoull(str, &end, 0);
+  if ((errno != 0) || (end == str)) {
+    return false;
+  }
+  switch (*end) {
+  case '\0':
+    unit = default_unit;
+    break;
+  case 'k':
+  case 'K':
+    unit = 1024;
+    break;
+  case 'm':
+  case 'M':
+    unit = 1024 * 1024;
+    break;
+  case 'g':
+  case 'G':
+    unit = 1024 * 1024 * 1024;
+    break;
+  default:
+    return false;
+  }
+  if ((*end != '\0') && (end[1] != '\0')) {
+    return false;
+  }
+  if (value > UINT64_MAX / unit) {
+    return false;
+  }
+  *size = value * unit;
+  return true;
+}
+
+bool pread_full(int fd, void *buf, uint64_t len, uint64_t offset) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool pwrite_full(int fd, const void *buf, uint64_t len, uint64_t offset) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
 } // namespace util
\ No newline at end of file
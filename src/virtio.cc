@@ -3,92 +3,361 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <iterator>
-#include <sstream>
+#include <mutex>
+#include <thread>
 
-#include "cpu.h"
+#include "mem.h"
 #include "log.h"
+#include "spsc_ring.h"
 #include "utils.h"
 
-Virtio::Virtio(const std::string &diskname) {
-  std::ifstream fin(diskname, std::ios::binary);
-  if (!fin) {
-    std::cerr << "Cannot open file " << diskname << std::endl;
-    exit(0);
+// Completions a worker can post before the vCPU reaps them. More than
+// queue_num_max, so push() does not fail in practice.
+const size_t IO_COMPLETION_RING_SIZE = 64;
+
+// Host thread serving block requests while the vCPU keeps executing
+// Requests come in through a locked queue the worker sleeps on. Completions go
+// back through a lock-free ring that only the vCPU thread reads.
+class IoWorker {
+public:
+  IoWorker(Virtio *virtio)
+      : completions(IO_COMPLETION_RING_SIZE), virtio_(virtio),
+        thread_(&IoWorker::run, this) {}
+
+  // Finish the queued requests and stop the thread.
+  ~IoWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  void submit(BlkRequest req) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(req));
+    }
+    cv_.notify_one();
+  }
+
+  SpscRing<BlkCompletion> completions;
+
+private:
+  void run() {
+    while (true) {
+      BlkRequest req;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        req = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      BlkCompletion completion = {req.queue, req.epoch, req.head,
+                                  virtio_->execute_request(req)};
+      while (!completions.push(completion)) {
+        std::this_thread::yield();
+      }
+      virtio_->events_->post(virtio_->completion_event_);
+    }
+  }
+
+  Virtio *virtio_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<BlkRequest> queue_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+Virtio::Virtio(const DiskOptions &options)
+    : disk(open_disk(options)) {
+  control_regs.version = options.virtio_version;
+  if (control_regs.version == 2) {
+    control_regs.host_features |= 1ull << VIRTIO_F_VERSION_1;
+  }
+  queues_.resize(options.num_queues);
+  reaped_.resize(options.num_queues);
+  if (options.num_queues > 1) {
+    control_regs.host_features |= 1ull << VIRTIO_BLK_F_MQ;
+  }
+  for (unsigned i = 0; i < options.io_threads; i++) {
+    workers_.push_back(std::make_unique<IoWorker>(this));
+  }
+}
+
+Virtio::~Virtio() = default;
+
+Desc::Desc(uint64_t base_addr, Mem *mem) {
+  addr = mem->load64(base_addr);
+  len = mem->load32(base_addr + 8);
+  flags = mem->load16(base_addr + 12);
+  next = mem->load16(base_addr + 14);
+}
+
+// Legacy interface: the queue is laid out contiguously from QueuePFN.
+// Virtqueue part, Alignment, Size
+// Descriptor Table, 16, 16*(Queue Size)
+// Available Ring, 2, 6 + 2*(Queue Size)
+// Used Ring, QueueAlign, 6 + 8*(Queue Size)
+void Virtio::setup_legacy_queue(Virtqueue &q) {
+  uint64_t page_size = control_regs.guest_page_size;
+  uint64_t align = q.align ? q.align : page_size;
+  q.desc_table = (uint64_t)q.pfn * page_size;
+  q.avail_ring = q.desc_table + q.num * VRING_DESC_SIZE;
+  q.used_ring = q.avail_ring + 6 + q.num * 2;
+  if (align) {
+    q.used_ring = (q.used_ring + align - 1) & ~(align - 1);
+  }
+  LOG_CPU("\tvirtqueue: desc=0x%lx, avail=0x%lx, used=0x%lx\n", q.desc_table,
+          q.avail_ring, q.used_ring);
+  LOG_CPU("\tvirtio.pfn = 0x%x\n", q.pfn);
+  LOG_CPU("\tvirtio.page_size = 0x%lx\n", page_size);
+  LOG_CPU("\tvirtio.queue_num = 0x%x\n", q.num);
+}
+
+// The queue QueueSel points at, or nullptr if there is no such queue.
+Virtqueue *Virtio::selected_queue() {
+  if (control_regs.queue_sel >= queues_.size()) {
+    return nullptr;
+  }
+  return &queues_[control_regs.queue_sel];
+}
+
+// Read up to 8 bytes of the configuration space from offset.
+// Fields past virtio_blk_config belong to features that are not offered and
+// read as zero.
+uint64_t Virtio::load_config(uint64_t offset) {
+  virtio_blk_config config = {};
+  config.capacity = disk->size() / SECTOR_SIZE;
+  config.seg_max = control_regs.queue_num_max - 2;
+  config.blk_size = SECTOR_SIZE;
+  // Guest writes may be cached (VIRTIO_BLK_F_CONFIG_WCE), so drivers send
+  // VIRTIO_BLK_T_FLUSH to make them durable.
+  config.writeback = 1;
+  config.num_queues = queues_.size();
+
+  uint64_t value = 0;
+  if (offset < sizeof(config)) {
+    memcpy(&value, (uint8_t *)&config + offset,
+           std::min<uint64_t>(sizeof(value), sizeof(config) - offset));
   }
+  LOG_CPU("virtio config load 0x%lx = 0x%lx\n", offset, value);
+  return value;
+}
 
-  fin.seekg(0, std::ios::end);
-  std::streamsize fsize = fin.tellg();
-  fin.seekg(0, std::ios::beg);
-  fin.unsetf(std::ios::skipws);
-  disk.insert(disk.begin(), std::istream_iterator<uint8_t>(fin),
-              std::istream_iterator<uint8_t>());
+// Writing zero to Status resets the device.
+// Requests still on the I/O threads are dropped when they complete, as their
+// queue has moved to a new epoch.
+void Virtio::reset() {
+  for (Virtqueue &q : queues_) {
+    q.reset();
+  }
+  control_regs.guest_features = 0;
+  control_regs.queue_sel = 0;
+  control_regs.interrupt_status = 0;
+  event_idx_ = false;
+  update_irq();
+}
 
-  fin.close();
-  LOG_SYSTEM("disk size: 0x%lx, loaded: 0x%lx\n", fsize, disk.size());
+void Virtio::init(Mem *mem, Gic *gic, EventQueue *events) {
+  assert(mem && gic && events);
+  mem_ = mem;
+  gic_ = gic;
+  events_ = events;
+  events_->add_async(completion_event_);
 }
 
-Desc::Desc(uint64_t base_addr, Cpu *cpu) {
-  addr = cpu->bus.mem.load64(base_addr);
-  len = cpu->bus.mem.load32(base_addr + 8);
-  flags = cpu->bus.mem.load16(base_addr + 12);
-  next = cpu->bus.mem.load16(base_addr + 14);
+// The interrupt line is asserted while InterruptStatus is non-zero.
+void Virtio::update_irq() {
+  gic_->set_level(GIC_SPI_VIRTIO, control_regs.interrupt_status != 0);
 }
 
-Virtqueue::Virtqueue(uint32_t pfn, uint32_t page_size, uint32_t queue_num) {
-  update(pfn, page_size, queue_num);
+void Virtio::shutdown() {
+  workers_.clear();
+  disk->flush();
 }
 
-void Virtqueue::update(uint32_t pfn, uint32_t page_size, uint32_t queue_num) {
-  uint64_t base = pfn * page_size;
-  // Virtqueue part, Alignment, Size
-  // Descriptor Table, 16, 16*(Queue Size)
-  // Available Ring, 2, 6 + 2*(Queue Size)
-  // Used Ring, 4, 6 + 8*(Queue Size)
-  desc_table = base;
-  avail_ring = base + queue_num * 16;
-  // used_ring = avail_ring + 6 + queue_num * 2;
-  used_ring = base + page_size;
-  LOG_CPU("\tvirtqueue: desc=0x%lx, avail=0x%lx, used=0x%lx\n", desc_table,
-          avail_ring, used_ring);
-  LOG_CPU("\tvirtio.pfn = 0x%x\n", pfn);
-  LOG_CPU("\tvirtio.page_size = 0x%x\n", page_size);
-  LOG_CPU("\tvirtio.queue_num = 0x%x\n", queue_num);
+// Consume every request the driver made available since the last
+// notification. Without I/O threads the requests are completed in order into
+// the used ring and a single interrupt is raised for the whole batch. With I/O
+// threads they are handed to the workers and completed by reap_completions().
+void Virtio::process_queue(uint32_t index) {
+  if (index >= queues_.size()) {
+    LOG_SYSTEM("virtio: notify to unknown queue %d\n", index);
+    return;
+  }
+  Virtqueue &q = queues_[index];
+  if (!q.active || (q.num == 0)) {
+    return;
+  }
+
+  uint16_t avail_idx = mem_->load16(q.avail_ring + 2);
+  uint16_t completed = 0;
+  while (q.last_avail_idx != avail_idx) {
+    uint16_t head =
+        mem_->load16(q.avail_ring + 4 + (q.last_avail_idx % q.num) * 2);
+    q.last_avail_idx++;
+
+    BlkRequest req = parse_request(q, head);
+    req.queue = index;
+    req.epoch = q.epoch;
+    if (workers_.empty()) {
+      push_used(q, head, execute_request(req));
+      completed++;
+      continue;
+    }
+    size_t worker;
+    if (queues_.size() > 1) {
+      // Each queue has its own worker when there are as many threads as
+      // queues, so queues do not contend with each other.
+      worker = index % workers_.size();
+    } else {
+      // Requests for the same sector go to the same worker, so they complete
+      // in the order the driver made them available.
+      worker = ((req.sector * 0x9e3779b97f4a7c15ull) >> 32) % workers_.size();
+    }
+    workers_[worker]->submit(std::move(req));
+    in_flight_++;
+  }
+  if (event_idx_) {
+    // Ask the driver to notify again once it makes the next request available.
+    mem_->store16(q.used_ring + 4 + q.num * 8, q.last_avail_idx);
+  }
+  publish_used(q, completed);
 }
 
-bool Virtio::is_interrupting() {
-  if (control_regs.queue_notify == 0) {
-    control_regs.queue_notify = UINT32_MAX;
-    return true;
+// The event is cleared before it runs, so a completion posted meanwhile
+// posts it again and is picked up by the next call.
+void Virtio::reap_completions() {
+  BlkCompletion completion;
+  for (auto &worker : workers_) {
+    while (worker->completions.pop(completion)) {
+      in_flight_--;
+      Virtqueue &q = queues_[completion.queue];
+      if (!q.active || (completion.epoch != q.epoch)) {
+        // reset or restarted while the request was in flight
+        continue;
+      }
+      push_used(q, completion.head, completion.len);
+      reaped_[completion.queue]++;
+    }
   }
-  return false;
+  for (size_t i = 0; i < queues_.size(); i++) {
+    if (reaped_[i]) {
+      publish_used(queues_[i], reaped_[i]);
+      reaped_[i] = 0;
+    }
+  }
+}
+
+void Virtio::push_used(Virtqueue &q, uint16_t head, uint32_t len) {
+  uint64_t used_elem = q.used_ring + 4 + (q.used_idx % q.num) * 8;
+  mem_->store32(used_elem, head);
+  mem_->store32(used_elem + 4, len);
+  q.used_idx++;
 }
 
-void Virtio::disk_access(Cpu *cpu) {
+// Make count used elements visible to the driver and notify it unless it
+// asked not to be.
+void Virtio::publish_used(Virtqueue &q, uint16_t count) {
+  if (!count) {
+    return;
+  }
+  mem_->store16(q.used_ring + 2, q.used_idx);
+  LOG_CPU("virtio: completed %d requests, used_idx=%d\n", count, q.used_idx);
+
+  bool notify;
+  if (event_idx_) {
+    uint16_t used_event = mem_->load16(q.avail_ring + 4 + q.num * 2);
+    notify = vring_need_event(used_event, q.used_idx, q.used_idx - count);
+  } else {
+    notify = !(mem_->load16(q.avail_ring) & VRING_AVAIL_F_NO_INTERRUPT);
+  }
+  if (!notify) {
+    return;
+  }
+
+  // Used Buffer Notification
+  control_regs.interrupt_status |= 0x1;
+  update_irq();
+}
+
+// Collect the buffers of the descriptor chain starting at head, following an
+// indirect descriptor table if there is one.
+// Returns false if the chain is malformed.
+bool Virtio::walk_chain(Virtqueue &q, uint16_t head,
+                        std::vector<BlkSegment> &segs) {
+  uint64_t table = q.desc_table;
+  uint32_t table_size = q.num;
+  bool indirect = false;
+  uint16_t idx = head;
+  // A chain visits each descriptor at most once, so a longer one has a loop.
+  uint32_t count = 0;
+  while (true) {
+    if ((idx >= table_size) || (count++ >= table_size)) {
+      LOG_SYSTEM("virtio: bad descriptor chain, head %d\n", head);
+      return false;
+    }
+    Desc desc = Desc(table + idx * VRING_DESC_SIZE, mem_);
+    LOG_CPU("desc%s[%d]: addr=0x%lx, len=0x%x, flags=%x, next=0x%x\n",
+            indirect ? "(indirect)" : "", idx, desc.addr, desc.len, desc.flags,
+            desc.next);
+
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+      // The indirect table holds the rest of the chain. It cannot nest or be
+      // followed by more descriptors.
+      if (indirect || (desc.flags & VRING_DESC_F_NEXT) || (desc.len == 0) ||
+          (desc.len % VRING_DESC_SIZE) || !mem_->in_ram(desc.addr, desc.len)) {
+        LOG_SYSTEM("virtio: bad indirect descriptor, head %d\n", head);
+        return false;
+      }
+      table = desc.addr;
+      table_size = desc.len / VRING_DESC_SIZE;
+      indirect = true;
+      idx = 0;
+      count = 0;
+      continue;
+    }
 
-  uint64_t first_index =
-      cpu->bus.mem.load64(virtqueue->avail_ring + 32 +
-                          virtqueue->avail_idx % control_regs.queue_num);
+    if (!mem_->in_ram(desc.addr, desc.len)) {
+      LOG_SYSTEM("virtio: buffer 0x%lx+0x%x is out of RAM\n", desc.addr,
+                 desc.len);
+      return false;
+    }
+    if (desc.len) {
+      segs.push_back(
+          {desc.addr, desc.len, (desc.flags & VRING_DESC_F_WRITE) != 0});
+    }
+    if (!(desc.flags & VRING_DESC_F_NEXT)) {
+      return true;
+    }
+    idx = desc.next;
+  }
+}
 
-  Desc desc0 = Desc(virtqueue->desc_table + first_index * VRING_DESC_SIZE, cpu);
-  Desc desc1 = Desc(virtqueue->desc_table + desc0.next * VRING_DESC_SIZE, cpu);
-  Desc desc2 = Desc(virtqueue->desc_table + desc1.next * VRING_DESC_SIZE, cpu);
-  LOG_CPU("desc0: addr=0x%lx, len=0x%x, flags=%x, next=0x%x\n", desc0.addr,
-          desc0.len, desc0.flags, desc0.next);
-  LOG_CPU("desc1: addr=0x%lx, len=0x%x, flags=%x, next=0x%x\n", desc1.addr,
-          desc1.len, desc1.flags, desc1.next);
-  LOG_CPU("desc2: addr=0x%lx, len=0x%x, flags=%x, next=0x%x\n", desc2.addr,
-          desc2.len, desc2.flags, desc2.next);
+// Decode the request whose descriptor chain starts at head.
+BlkRequest Virtio::parse_request(Virtqueue &q, uint16_t head) {
+  BlkRequest req = {};
+  req.head = head;
 
-  assert(desc0.flags & VRING_DESC_F_NEXT == 1);
-  assert(desc1.flags & VRING_DESC_F_NEXT == 1);
-  assert(desc2.flags & VRING_DESC_F_NEXT == 0);
+  std::vector<BlkSegment> segs;
+  if (!walk_chain(q, head, segs) || segs.empty()) {
+    return req;
+  }
 
   // struct virtio_blk_req {
   //   le32 type;
@@ -97,27 +366,162 @@ void Virtio::disk_access(Cpu *cpu) {
   //   u8 data[][512];
   //   u8 status;
   // };
-  uint64_t sector = cpu->bus.mem.load64(desc0.addr + 8);
-  if (desc1.flags & VRING_DESC_F_WRITE) {
+  // The request is a byte stream over the buffers, whatever the descriptor
+  // boundaries are: the header comes first and the status byte last. The
+  // device only reads the header and only writes the status byte.
+  BlkSegment &last = segs.back();
+  if (!last.writable) {
+    LOG_SYSTEM("virtio: status byte is read-only, head %d\n", head);
+    return req;
+  }
+  req.has_status = true;
+  req.status = last.addr + last.len - 1;
+  last.len--;
+
+  uint8_t header[VIRTIO_BLK_REQ_HEADER_SIZE];
+  uint64_t header_len = 0;
+  bool header_writable = false;
+  for (const BlkSegment &seg : segs) {
+    uint64_t n = std::min<uint64_t>(seg.len,
+                                    VIRTIO_BLK_REQ_HEADER_SIZE - header_len);
+    memcpy(header + header_len, (const void *)mem_->get_ptr(seg.addr), n);
+    header_len += n;
+    header_writable |= n && seg.writable;
+    if (seg.len > n) {
+      req.data.push_back({seg.addr + n, (uint32_t)(seg.len - n), seg.writable});
+    }
+  }
+  if (header_len < VIRTIO_BLK_REQ_HEADER_SIZE) {
+    LOG_SYSTEM("virtio: request too short, head %d\n", head);
+    return req;
+  }
+  if (header_writable) {
+    LOG_SYSTEM("virtio: request header is device-writable, head %d\n", head);
+    return req;
+  }
+  memcpy(&req.type, header, 4);
+  memcpy(&req.sector, header + 8, 8);
+  // Reads fill device-writable buffers and writes take read-only ones.
+  if ((req.type == VIRTIO_BLK_T_IN) || (req.type == VIRTIO_BLK_T_OUT)) {
+    for (const BlkSegment &seg : req.data) {
+      if (seg.writable != (req.type == VIRTIO_BLK_T_IN)) {
+        LOG_SYSTEM("virtio: data buffer 0x%lx has the wrong direction for "
+                   "type %d, head %d\n",
+                   seg.addr, req.type, head);
+        return req;
+      }
+    }
+  }
+  req.valid = true;
+  return req;
+}
+
+// Transfer the data of req and write its status byte.
+// Returns the number of bytes written to the driver's buffers.
+// This runs on the I/O threads, so it only touches the disk and guest RAM.
+uint32_t Virtio::execute_request(const BlkRequest &req) {
+  uint8_t status = VIRTIO_BLK_S_OK;
+  uint32_t written = 0;
+  uint64_t offset = req.sector * SECTOR_SIZE;
+  if (!req.valid || (req.sector >= disk->size() / SECTOR_SIZE)) {
+    status = VIRTIO_BLK_S_IOERR;
+  } else if (req.type == VIRTIO_BLK_T_IN) {
     // driver read, device write
-    for (uint16_t i = 0; i < desc1.len; i++) {
-      uint8_t data = disk[sector * SECTOR_SIZE + i];
-      cpu->bus.mem.store8(desc1.addr + i, data);
+    for (const BlkSegment &seg : req.data) {
+      if (!disk->read(offset, (uint8_t *)mem_->get_ptr(seg.addr), seg.len)) {
+        status = VIRTIO_BLK_S_IOERR;
+        break;
+      }
+      // DMA may overwrite pages that hold cached code, e.g. when exec loads a
+      // new program into recycled pages.
+      mem_->notify_write(seg.addr, seg.len);
+      offset += seg.len;
+      written += seg.len;
     }
-  } else {
+  } else if (req.type == VIRTIO_BLK_T_OUT) {
     // driver write, device read
-    for (uint16_t i = 0; i < desc1.len; i++) {
-      uint8_t data = cpu->bus.mem.load8(desc1.addr + i);
-      disk[sector * SECTOR_SIZE + i] = data;
+    for (const BlkSegment &seg : req.data) {
+      if (!disk->write(offset, (const uint8_t *)mem_->get_ptr(seg.addr),
+                      seg.len)) {
+        status = VIRTIO_BLK_S_IOERR;
+        break;
+      }
+      offset += seg.len;
     }
+  } else if (req.type == VIRTIO_BLK_T_FLUSH) {
+    if (!disk->flush()) {
+      status = VIRTIO_BLK_S_IOERR;
+    }
+  } else {
+    status = VIRTIO_BLK_S_UNSUPP;
+  }
+  if (status != VIRTIO_BLK_S_OK) {
+    LOG_SYSTEM("virtio: request failed, type %d, sector 0x%lx, status %d\n",
+               req.type, req.sector, status);
+  }
+  if (!req.has_status) {
+    return written;
+  }
+  mem_->store8(req.status, status);
+  return written + 1;
+}
+
+// Replace the low or high 32 bits of a 64-bit register.
+static void set_word(uint64_t *reg, bool high, uint64_t value) {
+  if (high) {
+    *reg = (*reg & 0xffffffff) | (value << 32);
+  } else {
+    *reg = (*reg & ~0xffffffffull) | (value & 0xffffffff);
+  }
+}
+
+// Store to a register of the queue selected by QueueSel.
+void Virtio::store_queue_reg(uint64_t addr, uint64_t value) {
+  Virtqueue *q = selected_queue();
+  if (!q) {
+    LOG_SYSTEM("virtio: store 0x%lx to unknown queue %d\n", addr,
+               control_regs.queue_sel);
+    return;
+  }
+  switch (addr) {
+  case VIRTIO_MMIO_QUEUE_NUM:
+    q->num = value;
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_NUM = 0x%x\n", q->num);
+    break;
+  case VIRTIO_MMIO_QUEUE_ALIGN:
+    q->align = value;
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_ALIGN = 0x%x\n", q->align);
+    break;
+  case VIRTIO_MMIO_QUEUE_PFN:
+    q->pfn = value;
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_PFN = 0x%x\n", q->pfn);
+    break;
+  case VIRTIO_MMIO_QUEUE_READY:
+    q->ready = value & 0x1;
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_READY = 0x%x\n", q->ready);
+    q->active = q->ready;
+    q->restart();
+    return;
+  case VIRTIO_MMIO_QUEUE_DESC_LOW:
+  case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+    set_word(&q->desc_table, addr == VIRTIO_MMIO_QUEUE_DESC_HIGH, value);
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_DESC = 0x%lx\n", q->desc_table);
+    return;
+  case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+  case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+    set_word(&q->avail_ring, addr == VIRTIO_MMIO_QUEUE_DRIVER_HIGH, value);
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_DRIVER = 0x%lx\n", q->avail_ring);
+    return;
+  case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+  case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+    set_word(&q->used_ring, addr == VIRTIO_MMIO_QUEUE_DEVICE_HIGH, value);
+    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_DEVICE = 0x%lx\n", q->used_ring);
+    return;
+  }
+  // The legacy layout depends on QueueNum, QueueAlign and QueuePFN.
+  if (q->active && (control_regs.version == 1)) {
+    setup_legacy_queue(*q);
   }
-  // Notification
-  cpu->bus.mem.store8(desc2.addr, 0);
-  cpu->bus.mem.store32(virtqueue->used_ring + 4 +
-                           (id % control_regs.queue_num) * 8,
-                       first_index);
-  id += 1;
-  cpu->bus.mem.store16(virtqueue->used_ring + 2, id);
 }
 
 void Virtio::store(uint64_t addr, uint64_t value) {
@@ -128,21 +532,39 @@ void Virtio::store(uint64_t addr, uint64_t value) {
   case VIRTIO_MMIO_VENDER_ID:
   case VIRTIO_MMIO_HOST_FEATURES:
   case VIRTIO_MMIO_QUEUE_NUM_MAX:
+  case VIRTIO_MMIO_CONFIG_GENERATION:
     // read only
     LOG_SYSTEM("err: virtio store to read-only register. 0x%lx\n", addr);
     assert(false);
     exit(1);
+  case VIRTIO_MMIO_HOST_FEATURES_SEL:
+    control_regs.host_features_sel = value;
+    LOG_CPU("virtio store VIRTIO_MMIO_DEVICE_FEATURES_SEL = 0x%x\n",
+            control_regs.host_features_sel);
+    break;
   case VIRTIO_MMIO_GUEST_FEATURES:
-    control_regs.guest_features = value;
-    LOG_CPU("virtio store VIRTIO_MMIO_DRIVER = 0x%x\n",
+    if (control_regs.guest_features_sel < 2) {
+      set_word(&control_regs.guest_features, control_regs.guest_features_sel,
+               value);
+    }
+    event_idx_ = (control_regs.guest_features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+    LOG_CPU("virtio store VIRTIO_MMIO_DRIVER = 0x%lx\n",
             control_regs.guest_features);
     break;
+  case VIRTIO_MMIO_GUEST_FEATURES_SEL:
+    control_regs.guest_features_sel = value;
+    LOG_CPU("virtio store VIRTIO_MMIO_DRIVER_FEATURES_SEL = 0x%x\n",
+            control_regs.guest_features_sel);
+    break;
   case VIRTIO_MMIO_GUEST_PAGE_SIZE:
     control_regs.guest_page_size = value;
     LOG_CPU("virtio store VIRTIO_MMIO_GUEST_PAGE_SIZE = 0x%lx\n",
             control_regs.guest_page_size);
-    virtqueue->update(control_regs.queue_pfn, control_regs.guest_page_size,
-                      control_regs.queue_num);
+    for (Virtqueue &q : queues_) {
+      if (q.active && (control_regs.version == 1)) {
+        setup_legacy_queue(q);
+      }
+    }
     break;
   case VIRTIO_MMIO_QUEUE_SEL:
     control_regs.queue_sel = value;
@@ -150,38 +572,51 @@ void Virtio::store(uint64_t addr, uint64_t value) {
             control_regs.queue_sel);
     break;
   case VIRTIO_MMIO_QUEUE_NUM:
-    control_regs.queue_num = value;
-    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_NUM = 0x%x\n",
-            control_regs.queue_num);
-    virtqueue->update(control_regs.queue_pfn, control_regs.guest_page_size,
-                      control_regs.queue_num);
-    break;
+  case VIRTIO_MMIO_QUEUE_ALIGN:
   case VIRTIO_MMIO_QUEUE_PFN:
-    control_regs.queue_pfn = value;
-    LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_PFN = 0x%x\n",
-            control_regs.queue_pfn);
-    virtqueue->update(control_regs.queue_pfn, control_regs.guest_page_size,
-                      control_regs.queue_num);
+  case VIRTIO_MMIO_QUEUE_READY:
+  case VIRTIO_MMIO_QUEUE_DESC_LOW:
+  case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+  case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+  case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+  case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+  case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+    store_queue_reg(addr, value);
     break;
   case VIRTIO_MMIO_QUEUE_NOTIFY:
     control_regs.queue_notify = value;
     LOG_CPU("virtio store VIRTIO_MMIO_QUEUE_NOTIFY = 0x%x\n",
             control_regs.queue_notify);
+    process_queue(control_regs.queue_notify);
     break;
   case VIRTIO_MMIO_INTERRUPT_ACK:
     control_regs.interrupt_ack = value;
+    control_regs.interrupt_status &= ~value;
+    update_irq();
     LOG_CPU("virtio store VIRTIO_MMIO_INTERRUPT_ACK = 0x%x\n",
             control_regs.interrupt_ack);
     break;
-  case VIRTIO_MMIO_STATUS:
+  case VIRTIO_MMIO_STATUS: {
+    bool driver_ok = control_regs.status & VIRTIO_CONFIG_S_DRIVER_OK;
     control_regs.status = value;
-    if (control_regs.status & 0x4) {
-      virtqueue =
-          Virtqueue(control_regs.queue_pfn, control_regs.guest_page_size,
-                    control_regs.queue_num);
+    if (control_regs.status == 0) {
+      reset();
+    } else if ((control_regs.version == 1) && !driver_ok &&
+               (control_regs.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+      // Legacy drivers start every queue they gave a PFN to when they set
+      // DRIVER_OK. Later status writes, e.g. to set NEEDS_RESET or FAILED,
+      // leave the running queues alone.
+      for (Virtqueue &q : queues_) {
+        if (q.pfn) {
+          setup_legacy_queue(q);
+          q.active = true;
+          q.restart();
+        }
+      }
     }
     LOG_CPU("virtio store VIRTIO_MMIO_STATUS = 0x%x\n", control_regs.status);
     break;
+  }
   default:
     LOG_SYSTEM("virtio store unsupported address 0x%lx\n", addr);
     exit(1);
@@ -190,11 +625,20 @@ void Virtio::store(uint64_t addr, uint64_t value) {
 
 uint64_t Virtio::load(uint64_t addr) {
   switch (addr) {
+  case VIRTIO_MMIO_HOST_FEATURES_SEL:
   case VIRTIO_MMIO_GUEST_FEATURES:
+  case VIRTIO_MMIO_GUEST_FEATURES_SEL:
   case VIRTIO_MMIO_GUEST_PAGE_SIZE:
   case VIRTIO_MMIO_QUEUE_SEL:
   case VIRTIO_MMIO_QUEUE_NUM:
+  case VIRTIO_MMIO_QUEUE_ALIGN:
   case VIRTIO_MMIO_QUEUE_NOTIFY:
+  case VIRTIO_MMIO_QUEUE_DESC_LOW:
+  case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+  case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+  case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+  case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+  case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
     // write only
     LOG_SYSTEM("err: virtio load to write-only register. 0x%lx\n", addr);
     assert(false);
@@ -212,17 +656,31 @@ uint64_t Virtio::load(uint64_t addr) {
   case VIRTIO_MMIO_VENDER_ID:
     LOG_CPU("virtio VIRTIO_MMIO_VENDER_ID = 0x%x\n", control_regs.vender_id);
     return control_regs.vender_id;
-  case VIRTIO_MMIO_HOST_FEATURES:
-    LOG_CPU("virtio VIRTIO_MMIO_DEVICE_FEATURES = 0x%x\n",
-            control_regs.host_features);
-    return control_regs.host_features;
-  case VIRTIO_MMIO_QUEUE_NUM_MAX:
-    LOG_CPU("virtio VIRTIO_MMIO_QUEUE_NUM_MAX = 0x%x\n",
-            control_regs.queue_num_max);
-    return control_regs.queue_num_max;
-  case VIRTIO_MMIO_QUEUE_PFN:
-    LOG_CPU("virtio VIRTIO_MMIO_QUEUE_PFN = 0x%x\n", control_regs.queue_pfn);
-    return control_regs.queue_pfn;
+  case VIRTIO_MMIO_HOST_FEATURES: {
+    uint32_t features = 0;
+    if (control_regs.host_features_sel < 2) {
+      features = control_regs.host_features >>
+                 (32 * control_regs.host_features_sel);
+    }
+    LOG_CPU("virtio VIRTIO_MMIO_DEVICE_FEATURES = 0x%x\n", features);
+    return features;
+  }
+  case VIRTIO_MMIO_QUEUE_NUM_MAX: {
+    // zero for queues that do not exist
+    uint32_t num_max = selected_queue() ? control_regs.queue_num_max : 0;
+    LOG_CPU("virtio VIRTIO_MMIO_QUEUE_NUM_MAX = 0x%x\n", num_max);
+    return num_max;
+  }
+  case VIRTIO_MMIO_QUEUE_PFN: {
+    uint32_t pfn = selected_queue() ? selected_queue()->pfn : 0;
+    LOG_CPU("virtio VIRTIO_MMIO_QUEUE_PFN = 0x%x\n", pfn);
+    return pfn;
+  }
+  case VIRTIO_MMIO_QUEUE_READY: {
+    uint32_t ready = selected_queue() ? selected_queue()->ready : 0;
+    LOG_CPU("virtio VIRTIO_MMIO_QUEUE_READY = 0x%x\n", ready);
+    return ready;
+  }
   case VIRTIO_MMIO_INTERRUPT_ACK:
     LOG_CPU("virtio VIRTIO_MMIO_INTERRUPT_ACK = 0x%x\n",
             control_regs.interrupt_ack);
@@ -234,8 +692,16 @@ uint64_t Virtio::load(uint64_t addr) {
   case VIRTIO_MMIO_STATUS:
     LOG_CPU("virtio VIRTIO_MMIO_STATUS = 0x%x\n", control_regs.status);
     return control_regs.status;
+  case VIRTIO_MMIO_CONFIG_GENERATION:
+    LOG_CPU("virtio VIRTIO_MMIO_CONFIG_GENERATION = 0x%x\n",
+            control_regs.config_generation);
+    return control_regs.config_generation;
   default:
+    if ((addr >= VIRTIO_MMIO_CONFIG) &&
+        (addr < VIRTIO_MMIO_CONFIG + VIRTIO_MMIO_CONFIG_SIZE)) {
+      return load_config(addr - VIRTIO_MMIO_CONFIG);
+    }
     LOG_SYSTEM("virtio load unsupported address 0x%lx\n", addr);
     exit(1);
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,13 @@
+#include "wakeup.h"
+
+void Wakeup::ring() {
+  // Pairs with the fence in wait_until(): either the vCPU sees the event or
+  // this sees it sleeping.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!sleeping_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  rung_ = true;
+  cv_.notify_one();
+}
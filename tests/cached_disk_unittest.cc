@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "cached_disk.h"
+
+// Three blocks, the last one partial
+const uint64_t IMAGE_SIZE = 2 * BLOCK_CACHE_BLOCK_SIZE + 3 * SECTOR_SIZE;
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), {});
+}
+
+// An image with a known pattern in a fresh temporary directory.
+class CachedDiskTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/cached_disk_unittest.XXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir = tmpl;
+    image = dir + "/disk.img";
+    pattern.resize(IMAGE_SIZE);
+    for (uint64_t i = 0; i < IMAGE_SIZE; i++) {
+      pattern[i] = (i * 13 + i / 509) & 0xff;
+    }
+    std::ofstream f(image, std::ios::binary | std::ios::trunc);
+    f.write((const char *)pattern.data(), pattern.size());
+  }
+
+  void TearDown() override {
+    unlink(image.c_str());
+    rmdir(dir.c_str());
+  }
+
+  std::string dir;
+  std::string image;
+  std::vector<uint8_t> pattern;
+};
+
+TEST_F(CachedDiskTest, ReadsAcrossBlocks) {
+  // One block of cache, so every block boundary is a miss and an eviction.
+  CachedDisk disk(image, DiskMode::Shared, BLOCK_CACHE_BLOCK_SIZE);
+  EXPECT_EQ(disk.size(), IMAGE_SIZE);
+  std::vector<uint8_t> data(IMAGE_SIZE);
+  ASSERT_TRUE(disk.read(0, data.data(), IMAGE_SIZE));
+  EXPECT_EQ(data, pattern);
+  EXPECT_FALSE(disk.read(IMAGE_SIZE - 1, data.data(), 2));
+}
+
+TEST_F(CachedDiskTest, WritebackReachesTheFileOnFlush) {
+  std::vector<uint8_t> expected = pattern;
+  {
+    CachedDisk disk(image, DiskMode::Writeback, 4 * BLOCK_CACHE_BLOCK_SIZE);
+    std::vector<uint8_t> data(2 * SECTOR_SIZE, 0xaa);
+    uint64_t offset = BLOCK_CACHE_BLOCK_SIZE - SECTOR_SIZE;
+    ASSERT_TRUE(disk.write(offset, data.data(), data.size()));
+    std::copy(data.begin(), data.end(), expected.begin() + offset);
+    EXPECT_EQ(read_file(image), pattern);
+    ASSERT_TRUE(disk.flush());
+    EXPECT_EQ(read_file(image), expected);
+  }
+  EXPECT_EQ(read_file(image), expected);
+}
+
+TEST_F(CachedDiskTest, PrivateWritesStayInMemory) {
+  std::vector<uint8_t> expected = pattern;
+  {
+    CachedDisk disk(image, DiskMode::Private, BLOCK_CACHE_BLOCK_SIZE);
+    std::vector<uint8_t> data(SECTOR_SIZE, 0xbb);
+    ASSERT_TRUE(disk.write(SECTOR_SIZE, data.data(), data.size()));
+    std::copy(data.begin(), data.end(), expected.begin() + SECTOR_SIZE);
+    // Read the other blocks so that the written one is evicted from the cache.
+    std::vector<uint8_t> all(IMAGE_SIZE);
+    ASSERT_TRUE(disk.read(BLOCK_CACHE_BLOCK_SIZE, all.data(),
+                          IMAGE_SIZE - BLOCK_CACHE_BLOCK_SIZE));
+    ASSERT_TRUE(disk.read(0, all.data(), IMAGE_SIZE));
+    EXPECT_EQ(all, expected);
+  }
+  EXPECT_EQ(read_file(image), pattern);
+}
+
+// A Private write to a block that cannot be read fails, and leaves nothing
+// behind for later reads of that block.
+TEST_F(CachedDiskTest, PrivateWriteWithFailedFetch) {
+  CachedDisk disk(image, DiskMode::Private, BLOCK_CACHE_BLOCK_SIZE);
+  // The image shrinks under the disk, so reading the last block is short.
+  ASSERT_EQ(truncate(image.c_str(), BLOCK_CACHE_BLOCK_SIZE), 0);
+  std::vector<uint8_t> data(SECTOR_SIZE, 0xcc);
+  uint64_t offset = 2 * BLOCK_CACHE_BLOCK_SIZE;
+  EXPECT_FALSE(disk.write(offset, data.data(), data.size()));
+  EXPECT_FALSE(disk.read(offset, data.data(), data.size()));
+
+  // Once the block is back, it is fetched and written as usual.
+  ASSERT_EQ(truncate(image.c_str(), IMAGE_SIZE), 0);
+  std::vector<uint8_t> written(SECTOR_SIZE, 0xdd);
+  ASSERT_TRUE(disk.write(offset, written.data(), written.size()));
+  ASSERT_TRUE(disk.read(offset, data.data(), data.size()));
+  EXPECT_EQ(data, written);
+}
@@ -0,0 +1,190 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "event_queue.h"
+
+// An event queue on the instruction clock, so virtual time is icount and
+// moves only when the test says so.
+class EventQueueTest : public ::testing::Test {
+protected:
+  EventQueueTest() : clock(TimerOptions{TimerClock::Icount, false}, &icount) {
+    events.init(&wakeup);
+    events.set_clock(&clock);
+  }
+
+  // Execute instructions up to icount == until, running events the way the
+  // CPU loop does.
+  void run_to(uint64_t until) {
+    while (icount < until) {
+      icount++;
+      if (icount >= events.next()) {
+        events.run();
+      }
+    }
+  }
+
+  uint64_t icount = 0;
+  Clock clock;
+  Wakeup wakeup;
+  EventQueue events;
+};
+
+TEST_F(EventQueueTest, RunsDueEventsInOrder) {
+  std::vector<std::pair<int, uint64_t>> log;
+  Event a([&] { log.push_back({1, icount}); });
+  Event b([&] { log.push_back({2, icount}); });
+  events.schedule(b, 200);
+  events.schedule(a, 100);
+  EXPECT_EQ(events.next(), 100u);
+  EXPECT_EQ(events.deadline(), 100u);
+  run_to(150);
+  ASSERT_EQ(log.size(), 1u);
+  EXPECT_EQ(log[0], std::make_pair(1, uint64_t(100)));
+  EXPECT_FALSE(a.scheduled());
+  EXPECT_TRUE(b.scheduled());
+  run_to(300);
+  ASSERT_EQ(log.size(), 2u);
+  EXPECT_EQ(log[1], std::make_pair(2, uint64_t(200)));
+  EXPECT_EQ(events.next(), UINT64_MAX);
+}
+
+TEST_F(EventQueueTest, CancelledEventDoesNotRun) {
+  int runs = 0;
+  Event e([&] { runs++; });
+  events.schedule(e, 100);
+  events.cancel(e);
+  EXPECT_FALSE(e.scheduled());
+  EXPECT_EQ(events.deadline(), UINT64_MAX);
+  run_to(200);
+  EXPECT_EQ(runs, 0);
+  // cancelling again is harmless
+  events.cancel(e);
+}
+
+TEST_F(EventQueueTest, RescheduleMovesTheEvent) {
+  std::vector<uint64_t> when;
+  Event e([&] { when.push_back(icount); });
+  events.schedule(e, 100);
+  events.schedule(e, 300);
+  run_to(200);
+  EXPECT_TRUE(when.empty());
+  events.schedule(e, 250);
+  run_to(400);
+  EXPECT_EQ(when, std::vector<uint64_t>({250}));
+}
+
+TEST_F(EventQueueTest, EventCanScheduleItselfAgain) {
+  std::vector<uint64_t> when;
+  Event periodic([&] {
+    when.push_back(icount);
+    if (when.size() < 3) {
+      events.schedule(periodic, icount + 10);
+    }
+  });
+  events.schedule(periodic, 10);
+  run_to(100);
+  EXPECT_EQ(when, std::vector<uint64_t>({10, 20, 30}));
+}
+
+TEST_F(EventQueueTest, PostRunsBeforeTheNextInstruction) {
+  int runs = 0;
+  Event e([&] { runs++; });
+  events.add_async(e);
+  events.schedule(e, 1000);
+  events.post(e);
+  EXPECT_EQ(events.next(), 0u);
+  run_to(1);
+  EXPECT_EQ(runs, 1);
+  // The posted run leaves the timed one alone.
+  EXPECT_EQ(events.next(), 1000u);
+}
+
+TEST_F(EventQueueTest, PostFromARunningEventIsNotLost) {
+  int runs = 0;
+  Event e([&] {
+    if (++runs == 1) {
+      events.post(e);
+    }
+  });
+  events.add_async(e);
+  events.post(e);
+  run_to(1);
+  EXPECT_EQ(runs, 1);
+  EXPECT_EQ(events.next(), 0u);
+  run_to(2);
+  EXPECT_EQ(runs, 2);
+  EXPECT_EQ(events.next(), UINT64_MAX);
+}
+
+// A host thread posts while the vCPU is in run(). Every post must be seen,
+// either by the run in progress or by pulling next() down for the next one.
+TEST_F(EventQueueTest, PostDuringRunFromAnotherThread) {
+  const uint64_t POSTS = 100000;
+  std::atomic<uint64_t> produced{0};
+  uint64_t consumed = 0;
+  Event e([&] { consumed = produced.load(std::memory_order_acquire); });
+  events.add_async(e);
+
+  std::thread producer([&] {
+    for (uint64_t i = 0; i < POSTS; i++) {
+      produced.fetch_add(1, std::memory_order_release);
+      events.post(e);
+    }
+  });
+  auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while ((consumed < POSTS) && (std::chrono::steady_clock::now() < give_up)) {
+    icount++;
+    if (icount >= events.next()) {
+      events.run();
+    }
+  }
+  producer.join();
+  EXPECT_EQ(consumed, POSTS);
+}
+
+// An idle vCPU sleeping until the next deadline is woken by a post.
+TEST_F(EventQueueTest, PostWakesASleepingCpu) {
+  bool ran = false;
+  Event e([&] { ran = true; });
+  events.add_async(e);
+  auto start = std::chrono::steady_clock::now();
+  std::thread producer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    events.post(e);
+  });
+  auto deadline = std::min(clock.host_time(events.deadline()),
+                           start + std::chrono::seconds(10));
+  wakeup.wait_until(deadline, [&] {
+    events.run();
+    return ran;
+  });
+  events.run();
+  producer.join();
+  EXPECT_TRUE(ran);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+}
+
+// With the host clock the CPU cannot check the time before every
+// instruction, so it polls every TIMER_HOST_POLL instructions while an event
+// is pending, and not at all otherwise.
+TEST(EventQueueHostClock, PollsOnlyWhileAnEventIsPending) {
+  uint64_t icount = 0;
+  Clock clock(TimerOptions{TimerClock::Host, false}, &icount);
+  Wakeup wakeup;
+  EventQueue events;
+  events.init(&wakeup);
+  events.set_clock(&clock);
+  EXPECT_EQ(events.next(), UINT64_MAX);
+
+  Event e([] {});
+  events.schedule(e, clock.now() + 60 * TIMER_FREQ);
+  EXPECT_LE(events.next(), icount + TIMER_HOST_POLL);
+  events.cancel(e);
+  events.run();
+  EXPECT_EQ(events.next(), UINT64_MAX);
+}
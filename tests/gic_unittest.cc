@@ -0,0 +1,176 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "gic.h"
+
+// SPIs without a device behind them
+const uint32_t SPI_A = 40;
+const uint32_t SPI_B = 41;
+
+// A GIC with affinity routing, group 1 enabled and every SPI and PPI enabled
+// at the lowest priority; the CPU interface lets everything through.
+class GicTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    gic.store(GICD_CTLR, GICD_CTLR_ENABLE_GRP1 | GICD_CTLR_ARE);
+    gic.store(GICD_ISENABLER + 4, ~0u);
+    gic.store(GIC_REDIST + GICR_ISENABLER0, ~0u);
+    gic.set_igrpen1(0, 1);
+    gic.set_pmr(0, 0xff);
+    set_priority(SPI_A, 0xa0);
+    set_priority(SPI_B, 0xa0);
+  }
+
+  // Word accesses are aligned, any other offset is a byte access.
+  void set_priority(uint32_t irq, uint8_t priority) {
+    uint64_t reg = ((irq < 32) ? GIC_REDIST + GICR_IPRIORITYR
+                               : GICD_IPRIORITYR) +
+                   irq;
+    if (irq % 4) {
+      gic.store(reg, priority);
+    } else {
+      gic.store(reg, (gic.load(reg) & ~0xffull) | priority);
+    }
+  }
+
+  Gic gic;
+};
+
+TEST_F(GicTest, NothingPendingIsSpurious) {
+  EXPECT_FALSE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+TEST_F(GicTest, DisabledDistributorIsSpurious) {
+  gic.store(GICD_CTLR, GICD_CTLR_ARE);
+  gic.raise(SPI_A);
+  EXPECT_FALSE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+TEST_F(GicTest, PriorityTieGoesToLowestIntid) {
+  gic.raise(SPI_B);
+  gic.raise(SPI_A);
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  // SPI_B has the same priority, so it cannot preempt SPI_A.
+  EXPECT_FALSE(gic.irq_line(0));
+  gic.end_of_interrupt(0, SPI_A);
+  EXPECT_EQ(gic.acknowledge(0), SPI_B);
+  gic.end_of_interrupt(0, SPI_B);
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+TEST_F(GicTest, HigherPriorityWinsAndPreempts) {
+  set_priority(SPI_B, 0x20);
+  gic.raise(SPI_A);
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  gic.raise(SPI_B);
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.running_priority(0), 0xa0u);
+  EXPECT_EQ(gic.acknowledge(0), SPI_B);
+  EXPECT_EQ(gic.running_priority(0), 0x20u);
+  gic.end_of_interrupt(0, SPI_B);
+  gic.end_of_interrupt(0, SPI_A);
+  EXPECT_EQ(gic.running_priority(0), GIC_IDLE_PRIORITY);
+}
+
+TEST_F(GicTest, PriorityMaskHoldsBackLowerPriorities) {
+  gic.raise(SPI_A);
+  // Only priorities strictly below the mask are signalled.
+  gic.set_pmr(0, 0xa0);
+  EXPECT_FALSE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+  gic.set_pmr(0, 0xa8);
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+}
+
+TEST_F(GicTest, LevelLineStaysPendingAcrossEoi) {
+  gic.set_level(SPI_A, true);
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  EXPECT_FALSE(gic.irq_line(0));
+  // Still asserted: taken again after EOI.
+  gic.end_of_interrupt(0, SPI_A);
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  // Deasserted while active: gone after EOI.
+  gic.set_level(SPI_A, false);
+  gic.end_of_interrupt(0, SPI_A);
+  EXPECT_FALSE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+TEST_F(GicTest, EdgeIsTakenOnce) {
+  gic.raise(SPI_A);
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  gic.end_of_interrupt(0, SPI_A);
+  EXPECT_FALSE(gic.irq_line(0));
+}
+
+TEST_F(GicTest, ClearPendingKeepsAssertedLevel) {
+  gic.set_level(SPI_A, true);
+  gic.raise(SPI_B);
+  gic.store(GICD_ICPENDR + 4, (1u << (SPI_A % 32)) | (1u << (SPI_B % 32)));
+  EXPECT_EQ(gic.acknowledge(0), SPI_A);
+  gic.end_of_interrupt(0, SPI_A);
+  gic.set_level(SPI_A, false);
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+TEST_F(GicTest, PpiIsBankedPerCpu) {
+  set_priority(GIC_PPI_VTIMER, 0x80);
+  gic.set_level(GIC_PPI_VTIMER, true, 0);
+  EXPECT_EQ(gic.acknowledge(0), GIC_PPI_VTIMER);
+  gic.set_level(GIC_PPI_VTIMER, false, 0);
+  gic.end_of_interrupt(0, GIC_PPI_VTIMER);
+  EXPECT_EQ(gic.acknowledge(0), GIC_SPURIOUS);
+}
+
+// Without affinity routing the SGI and PPI registers of CPU 0 show through
+// the distributor, PPI trigger configuration and priorities included.
+TEST_F(GicTest, LegacyDistributorBanksPpiRegisters) {
+  gic.store(GICD_CTLR, GICD_CTLR_ENABLE_GRP1);
+  // PPI 27 level-sensitive (ICFGR1 bits 23:22 = 0b00), the others edge
+  gic.store(GICD_ICFGR + 4, 0xff3fffff);
+  gic.store(GICD_IPRIORITYR + 24, 0x40302010);
+  EXPECT_EQ(gic.load(GICD_ICFGR + 4), 0xff3fffffu);
+  EXPECT_EQ(gic.load(GIC_REDIST + GICR_ICFGR0 + 4), 0xff3fffffu);
+  EXPECT_EQ(gic.load(GIC_REDIST + GICR_IPRIORITYR + 24), 0x40302010u);
+
+  // With affinity routing they are only in the redistributor.
+  gic.store(GICD_CTLR, GICD_CTLR_ENABLE_GRP1 | GICD_CTLR_ARE);
+  EXPECT_EQ(gic.load(GICD_ICFGR + 4), 0u);
+  EXPECT_EQ(gic.load(GICD_IPRIORITYR + 24), 0u);
+  gic.store(GICD_ICFGR + 4, 0);
+  EXPECT_EQ(gic.load(GIC_REDIST + GICR_ICFGR0 + 4), 0xff3fffffu);
+}
+
+TEST_F(GicTest, SgiToSelf) {
+  // ICC_SGI1R_EL1: INTID 5, target list CPU 0
+  gic.send_sgi(0, (5ull << 24) | 1);
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), 5u);
+  gic.end_of_interrupt(0, 5);
+  // IRM: every CPU but the sender, so none here
+  gic.send_sgi(0, (5ull << 24) | (1ull << 40));
+  EXPECT_FALSE(gic.irq_line(0));
+}
+
+TEST_F(GicTest, SgiWakesSleepingCpu) {
+  Wakeup wakeup;
+  gic.set_wakeup(0, &wakeup);
+  auto start = std::chrono::steady_clock::now();
+  std::thread cpu([&] {
+    wakeup.wait_until(start + std::chrono::seconds(10),
+                      [&] { return gic.irq_line(0); });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  gic.send_sgi(0, (5ull << 24) | 1);
+  cpu.join();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  EXPECT_TRUE(gic.irq_line(0));
+  EXPECT_EQ(gic.acknowledge(0), 5u);
+}
@@ -0,0 +1,142 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "mem.h"
+
+const uint64_t RAM_BASE = 0x40000000;
+// 256 pages, so the bitmaps span several words
+const uint64_t RAM_SIZE = 1024 * 1024;
+
+// Guest RAM backed by a host buffer
+class MemTest : public ::testing::Test {
+protected:
+  MemTest() : ram(RAM_SIZE) {
+    mem.init(RAM_BASE, 0, (uint64_t)ram.data(), RAM_SIZE);
+  }
+
+  std::vector<uint8_t> ram;
+  Mem mem;
+};
+
+TEST_F(MemTest, StoreMarksItsPage) {
+  EXPECT_EQ(mem.count_dirty(), 0u);
+  mem.store32(RAM_BASE + 5 * GUEST_PAGE_SIZE + 8, 0x12345678);
+  EXPECT_EQ(mem.load32(RAM_BASE + 5 * GUEST_PAGE_SIZE + 8), 0x12345678u);
+  EXPECT_TRUE(mem.is_dirty(RAM_BASE + 5 * GUEST_PAGE_SIZE));
+  EXPECT_FALSE(mem.is_dirty(RAM_BASE + 4 * GUEST_PAGE_SIZE));
+  EXPECT_FALSE(mem.is_dirty(RAM_BASE + 6 * GUEST_PAGE_SIZE));
+  // Storing to a dirty page again changes nothing.
+  mem.store8(RAM_BASE + 5 * GUEST_PAGE_SIZE, 1);
+  EXPECT_EQ(mem.count_dirty(), 1u);
+}
+
+TEST_F(MemTest, StoreAcrossPagesMarksBoth) {
+  mem.store64(RAM_BASE + 64 * GUEST_PAGE_SIZE - 4, ~0ull);
+  EXPECT_TRUE(mem.is_dirty(RAM_BASE + 63 * GUEST_PAGE_SIZE));
+  EXPECT_TRUE(mem.is_dirty(RAM_BASE + 64 * GUEST_PAGE_SIZE));
+  EXPECT_EQ(mem.count_dirty(), 2u);
+}
+
+TEST_F(MemTest, NotifyWriteMarksTheRange) {
+  mem.notify_write(RAM_BASE + 10 * GUEST_PAGE_SIZE + 1, 3 * GUEST_PAGE_SIZE);
+  EXPECT_EQ(mem.count_dirty(), 4u);
+  EXPECT_TRUE(mem.is_dirty(RAM_BASE + 13 * GUEST_PAGE_SIZE));
+  EXPECT_FALSE(mem.is_dirty(RAM_BASE + 14 * GUEST_PAGE_SIZE));
+  // The part beyond RAM is ignored.
+  mem.notify_write(RAM_BASE + RAM_SIZE - 16, 64);
+  EXPECT_EQ(mem.count_dirty(), 5u);
+  EXPECT_FALSE(mem.is_dirty(RAM_BASE + RAM_SIZE));
+}
+
+TEST_F(MemTest, CollectDirtyReturnsAndClearsPages) {
+  mem.store8(RAM_BASE + 200 * GUEST_PAGE_SIZE, 1);
+  mem.store8(RAM_BASE, 1);
+  mem.store8(RAM_BASE + 65 * GUEST_PAGE_SIZE + 100, 1);
+  std::vector<uint64_t> pages;
+  mem.collect_dirty(pages);
+  EXPECT_EQ(pages, std::vector<uint64_t>({RAM_BASE,
+                                          RAM_BASE + 65 * GUEST_PAGE_SIZE,
+                                          RAM_BASE + 200 * GUEST_PAGE_SIZE}));
+  EXPECT_EQ(mem.count_dirty(), 0u);
+  pages.clear();
+  mem.collect_dirty(pages);
+  EXPECT_TRUE(pages.empty());
+}
+
+// Code page tracking, as a decode cache would use it: the callbacks get the
+// range of every tracked page that is written, once, on the writing thread.
+class MemCodeTest : public MemTest {
+protected:
+  MemCodeTest() {
+    mem.add_code_invalidate_callback([this](uint64_t paddr, uint64_t len) {
+      invalidated.push_back({paddr, len});
+    });
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> invalidated;
+};
+
+TEST_F(MemCodeTest, StoreInvalidatesTrackedPageOnce) {
+  uint64_t page = RAM_BASE + 3 * GUEST_PAGE_SIZE;
+  mem.track_code_page(page + 0x40);
+  EXPECT_TRUE(mem.is_code_page(page));
+  // Other pages are not tracked.
+  mem.store32(page + GUEST_PAGE_SIZE, 0);
+  EXPECT_TRUE(invalidated.empty());
+
+  mem.store32(page + 0x80, 0xd503201f);
+  ASSERT_EQ(invalidated.size(), 1u);
+  EXPECT_EQ(invalidated[0], std::make_pair(page, GUEST_PAGE_SIZE));
+  EXPECT_FALSE(mem.is_code_page(page));
+  // Untracked now, so the next store is not reported again.
+  mem.store32(page + 0x84, 0xd503201f);
+  EXPECT_EQ(invalidated.size(), 1u);
+}
+
+TEST_F(MemCodeTest, NotifyWriteInvalidatesEveryTrackedPageInRange) {
+  for (uint64_t i = 8; i < 12; i++) {
+    mem.track_code_page(RAM_BASE + i * GUEST_PAGE_SIZE);
+  }
+  // DMA over pages 9 and 10, as a virtio-blk read into guest memory does
+  mem.notify_write(RAM_BASE + 9 * GUEST_PAGE_SIZE + 512, GUEST_PAGE_SIZE);
+  ASSERT_EQ(invalidated.size(), 2u);
+  EXPECT_EQ(invalidated[0].first, RAM_BASE + 9 * GUEST_PAGE_SIZE);
+  EXPECT_EQ(invalidated[1].first, RAM_BASE + 10 * GUEST_PAGE_SIZE);
+  EXPECT_TRUE(mem.is_code_page(RAM_BASE + 8 * GUEST_PAGE_SIZE));
+  EXPECT_TRUE(mem.is_code_page(RAM_BASE + 11 * GUEST_PAGE_SIZE));
+  EXPECT_TRUE(mem.is_dirty(RAM_BASE + 10 * GUEST_PAGE_SIZE));
+}
+
+TEST_F(MemCodeTest, TrackingTwiceNeedsOneWrite) {
+  uint64_t page = RAM_BASE + 20 * GUEST_PAGE_SIZE;
+  mem.track_code_page(page);
+  mem.track_code_page(page + 4);
+  mem.notify_write(page, 4);
+  EXPECT_EQ(invalidated.size(), 1u);
+  EXPECT_FALSE(mem.is_code_page(page));
+}
+
+TEST_F(MemCodeTest, InvalidateAllCode) {
+  mem.track_code_page(RAM_BASE);
+  mem.track_code_page(RAM_BASE + 100 * GUEST_PAGE_SIZE);
+  mem.invalidate_all_code();
+  ASSERT_EQ(invalidated.size(), 1u);
+  EXPECT_EQ(invalidated[0], std::make_pair(RAM_BASE, RAM_SIZE));
+  EXPECT_FALSE(mem.is_code_page(RAM_BASE));
+  // Nothing is tracked any more, so writes are not reported.
+  mem.store8(RAM_BASE + 100 * GUEST_PAGE_SIZE, 0);
+  EXPECT_EQ(invalidated.size(), 1u);
+}
+
+// Without a code cache stores do not look at the code bitmap at all.
+TEST_F(MemTest, NothingIsTrackedWithoutACodeCache) {
+  mem.track_code_page(RAM_BASE);
+  EXPECT_FALSE(mem.is_code_page(RAM_BASE));
+}
+
+TEST_F(MemCodeTest, OutsideRamIsNotTracked) {
+  mem.track_code_page(RAM_BASE + RAM_SIZE);
+  EXPECT_FALSE(mem.is_code_page(RAM_BASE + RAM_SIZE));
+}
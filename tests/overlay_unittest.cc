@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "overlay.h"
+
+// Two full clusters and a partial one
+const uint64_t BASE_SIZE = 2 * OVERLAY_CLUSTER_SIZE + 5 * SECTOR_SIZE;
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), {});
+}
+
+static void write_file(const std::string &path,
+                       const std::vector<uint8_t> &data) {
+  std::ofstream f(path, std::ios::binary | std::ios::trunc);
+  f.write((const char *)data.data(), data.size());
+}
+
+// A base image with a known pattern and the path of its overlay, in a fresh
+// temporary directory.
+class OverlayTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/overlay_unittest.XXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir = tmpl;
+    base = dir + "/base.img";
+    overlay = dir + "/delta.ov";
+    pattern.resize(BASE_SIZE);
+    for (uint64_t i = 0; i < BASE_SIZE; i++) {
+      pattern[i] = (i * 7 + i / 251) & 0xff;
+    }
+    write_file(base, pattern);
+  }
+
+  void TearDown() override {
+    unlink(base.c_str());
+    unlink(overlay.c_str());
+    rmdir(dir.c_str());
+  }
+
+  // Write len bytes of value at offset through a new OverlayDisk and apply
+  // the same change to expected.
+  void write_through_overlay(uint64_t offset, uint64_t len, uint8_t value,
+                             std::vector<uint8_t> &expected) {
+    OverlayDisk disk(base, overlay);
+    std::vector<uint8_t> data(len, value);
+    ASSERT_TRUE(disk.write(offset, data.data(), len));
+    ASSERT_TRUE(disk.flush());
+    std::copy(data.begin(), data.end(), expected.begin() + offset);
+  }
+
+  std::string dir;
+  std::string base;
+  std::string overlay;
+  std::vector<uint8_t> pattern;
+};
+
+TEST_F(OverlayTest, WritesStayInTheOverlayUntilCommitted) {
+  std::vector<uint8_t> expected = pattern;
+  // within a cluster, across clusters and in the partial last cluster
+  write_through_overlay(100, 1000, 0xaa, expected);
+  write_through_overlay(OVERLAY_CLUSTER_SIZE - 512, 1024, 0xbb, expected);
+  write_through_overlay(BASE_SIZE - 700, 700, 0xcc, expected);
+  EXPECT_EQ(read_file(base), pattern);
+
+  {
+    OverlayDisk disk(base, overlay);
+    EXPECT_EQ(disk.size(), BASE_SIZE);
+    std::vector<uint8_t> data(BASE_SIZE);
+    ASSERT_TRUE(disk.read(0, data.data(), BASE_SIZE));
+    EXPECT_EQ(data, expected);
+    EXPECT_FALSE(disk.read(BASE_SIZE - 1, data.data(), 2));
+  }
+
+  EXPECT_EQ(commit_overlay(overlay, base), 0);
+  EXPECT_EQ(read_file(base), expected);
+}
+
+TEST_F(OverlayTest, CommitOfAnEmptyOverlayChangesNothing) {
+  { OverlayDisk disk(base, overlay); }
+  EXPECT_EQ(commit_overlay(overlay, base), 0);
+  EXPECT_EQ(read_file(base), pattern);
+}
+
+TEST_F(OverlayTest, CommitRejectsABadIndex) {
+  std::vector<uint8_t> expected = pattern;
+  write_through_overlay(0, 512, 0xaa, expected);
+  OverlayHeader header;
+  int fd = open(overlay.c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(pread(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+  // entries that are not cluster aligned, point into the index or past the
+  // end of the file
+  for (uint64_t bad : {uint64_t(OVERLAY_CLUSTER_SIZE + 1), uint64_t(8),
+                       uint64_t(64 * OVERLAY_CLUSTER_SIZE)}) {
+    ASSERT_EQ(pwrite(fd, &bad, sizeof(bad), header.index_offset + sizeof(bad)),
+              (ssize_t)sizeof(bad));
+    EXPECT_EQ(commit_overlay(overlay, base), -1);
+    EXPECT_EQ(read_file(base), pattern);
+  }
+  close(fd);
+}
+
+TEST_F(OverlayTest, CommitRejectsAnotherBase) {
+  std::vector<uint8_t> expected = pattern;
+  write_through_overlay(0, 512, 0xaa, expected);
+  std::vector<uint8_t> other(BASE_SIZE + SECTOR_SIZE);
+  write_file(base, other);
+  EXPECT_EQ(commit_overlay(overlay, base), -1);
+  EXPECT_EQ(read_file(base), other);
+}
+
+// New clusters only enter the index in the file on flush, after their data.
+TEST_F(OverlayTest, IndexEntriesAreWrittenOnFlush) {
+  OverlayDisk disk(base, overlay);
+  std::vector<uint8_t> data(SECTOR_SIZE, 0xaa);
+  ASSERT_TRUE(disk.write(OVERLAY_CLUSTER_SIZE, data.data(), data.size()));
+
+  OverlayHeader header;
+  uint64_t entry = ~0ull;
+  int fd = open(overlay.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(pread(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+  uint64_t entry_offset = header.index_offset + sizeof(entry);
+  ASSERT_EQ(pread(fd, &entry, sizeof(entry), entry_offset),
+            (ssize_t)sizeof(entry));
+  EXPECT_EQ(entry, 0u);
+  // The write is visible before the flush all the same.
+  std::vector<uint8_t> back(SECTOR_SIZE);
+  ASSERT_TRUE(disk.read(OVERLAY_CLUSTER_SIZE, back.data(), back.size()));
+  EXPECT_EQ(back, data);
+
+  ASSERT_TRUE(disk.flush());
+  ASSERT_EQ(pread(fd, &entry, sizeof(entry), entry_offset),
+            (ssize_t)sizeof(entry));
+  EXPECT_NE(entry, 0u);
+  EXPECT_EQ(entry % OVERLAY_CLUSTER_SIZE, 0u);
+  close(fd);
+}
+
+TEST_F(OverlayTest, ClosingFlushesTheIndex) {
+  std::vector<uint8_t> expected = pattern;
+  {
+    OverlayDisk disk(base, overlay);
+    std::vector<uint8_t> data(SECTOR_SIZE, 0xbb);
+    ASSERT_TRUE(disk.write(0, data.data(), data.size()));
+    std::copy(data.begin(), data.end(), expected.begin());
+  }
+  EXPECT_EQ(commit_overlay(overlay, base), 0);
+  EXPECT_EQ(read_file(base), expected);
+}
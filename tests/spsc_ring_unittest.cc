@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <thread>
+
+#include "spsc_ring.h"
+
+TEST(SpscRing, CapacityIsRoundedUpToAPowerOfTwo) {
+  EXPECT_EQ(SpscRing<int>(1).capacity(), 1u);
+  EXPECT_EQ(SpscRing<int>(5).capacity(), 8u);
+  EXPECT_EQ(SpscRing<int>(64).capacity(), 64u);
+}
+
+TEST(SpscRing, FifoOrderAndFull) {
+  SpscRing<int> ring(4);
+  int value;
+  EXPECT_TRUE(ring.empty());
+  EXPECT_FALSE(ring.pop(value));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(ring.push(i));
+  }
+  EXPECT_EQ(ring.size(), 4u);
+  EXPECT_FALSE(ring.push(4));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(ring.pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_TRUE(ring.empty());
+}
+
+// The indices keep counting past the capacity; slots are reused modulo it.
+TEST(SpscRing, WrapsAround) {
+  SpscRing<int> ring(4);
+  int value;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(ring.push(i));
+    EXPECT_TRUE(ring.push(i + 1000));
+    ASSERT_TRUE(ring.pop(value));
+    EXPECT_EQ(value, i);
+    ASSERT_TRUE(ring.pop(value));
+    EXPECT_EQ(value, i + 1000);
+  }
+  EXPECT_TRUE(ring.empty());
+}
+
+// A producer and a consumer thread hand over a sequence through a small
+// ring, so it is full and empty many times. Nothing may be lost, duplicated
+// or reordered.
+TEST(SpscRing, ProducerAndConsumerThreads) {
+  const uint64_t COUNT = 1000000;
+  SpscRing<uint64_t> ring(16);
+  std::thread producer([&] {
+    for (uint64_t i = 0; i < COUNT; i++) {
+      while (!ring.push(i)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint64_t expected = 0;
+  uint64_t value;
+  bool in_order = true;
+  while (expected < COUNT) {
+    if (!ring.pop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    in_order &= (value == expected);
+    expected++;
+  }
+  producer.join();
+  EXPECT_TRUE(in_order);
+  EXPECT_TRUE(ring.empty());
+}
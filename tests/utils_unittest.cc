@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "utils.h"
+
+const uint64_t MIB = 1024 * 1024;
+
+TEST(ParseSize, Suffixes) {
+  uint64_t size = 0;
+  EXPECT_TRUE(util::parse_size("512", 1, &size));
+  EXPECT_EQ(size, 512u);
+  EXPECT_TRUE(util::parse_size("64K", 1, &size));
+  EXPECT_EQ(size, 64u * 1024);
+  EXPECT_TRUE(util::parse_size("64k", 1, &size));
+  EXPECT_EQ(size, 64u * 1024);
+  EXPECT_TRUE(util::parse_size("256M", 1, &size));
+  EXPECT_EQ(size, 256 * MIB);
+  EXPECT_TRUE(util::parse_size("2G", 1, &size));
+  EXPECT_EQ(size, 2048 * MIB);
+  EXPECT_TRUE(util::parse_size("0x10M", 1, &size));
+  EXPECT_EQ(size, 16 * MIB);
+}
+
+TEST(ParseSize, BareNumberUsesDefaultUnit) {
+  uint64_t size = 0;
+  EXPECT_TRUE(util::parse_size("128", MIB, &size));
+  EXPECT_EQ(size, 128 * MIB);
+  // A suffix overrides the default unit.
+  EXPECT_TRUE(util::parse_size("128K", MIB, &size));
+  EXPECT_EQ(size, 128u * 1024);
+}
+
+TEST(ParseSize, RejectsMalformedInput) {
+  uint64_t size = 42;
+  EXPECT_FALSE(util::parse_size("", 1, &size));
+  EXPECT_FALSE(util::parse_size("M", 1, &size));
+  EXPECT_FALSE(util::parse_size("12X", 1, &size));
+  EXPECT_FALSE(util::parse_size("12KB", 1, &size));
+  EXPECT_FALSE(util::parse_size("1 M", 1, &size));
+  EXPECT_FALSE(util::parse_size("-2", 1, &size));
+  EXPECT_FALSE(util::parse_size("-1K", 1, &size));
+  // size is left alone on errors
+  EXPECT_EQ(size, 42u);
+}
+
+TEST(ParseSize, RejectsOverflow) {
+  uint64_t size = 0;
+  EXPECT_TRUE(util::parse_size("18446744073709551615", 1, &size));
+  EXPECT_EQ(size, UINT64_MAX);
+  EXPECT_FALSE(util::parse_size("18446744073709551616", 1, &size));
+  EXPECT_FALSE(util::parse_size("17179869184G", 1, &size));
+  EXPECT_FALSE(util::parse_size("17592186044416", MIB, &size));
+}